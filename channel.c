@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "channel.h"
+
+static inline
+void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+int channel_create(struct channel *ch, unsigned size)
+{
+	int rv;
+
+	rv = fifo_create_sized(&ch->request, size);
+	if (rv)
+		return rv;
+	rv = fifo_create_sized(&ch->response, size);
+	if (rv) {
+		fifo_destroy(ch->request);
+		return rv;
+	}
+	return 0;
+}
+
+void channel_destroy(struct channel *ch)
+{
+	fifo_destroy(ch->request);
+	fifo_destroy(ch->response);
+}
+
+static
+void endpoint_init(struct channel_endpoint *ep, struct shm_fifo *out, struct shm_fifo *in)
+{
+	/* min_length of 0: channel does waiting itself, as it needs
+	 * whole messages rather than fixed amount of bytes */
+	fifo_window_init_writer(out, &ep->out, 0, out->size);
+	fifo_window_init_reader(in, &ep->in, 0, in->size);
+	/* spinning only delays other side on uniprocessor */
+	ep->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CHANNEL_SPIN_COUNT : 0;
+	ep->next_id = 1;
+	ep->pending = 0;
+}
+
+void channel_client_init(struct channel *ch, struct channel_endpoint *ep)
+{
+	endpoint_init(ep, ch->request, ch->response);
+}
+
+void channel_server_init(struct channel *ch, struct channel_endpoint *ep)
+{
+	endpoint_init(ep, ch->response, ch->request);
+}
+
+void channel_flush(struct channel_endpoint *ep)
+{
+	if (!ep->pending)
+		return;
+	fifo_window_exchange_writer(&ep->out);
+	ep->pending = 0;
+}
+
+/* waits until writer window has at least len bytes. Pending messages
+ * are published along the way */
+static
+void reserve(struct channel_endpoint *ep, unsigned len)
+{
+	while (ep->out.len < len) {
+		fifo_window_exchange_writer(&ep->out);
+		ep->pending = 0;
+		if (ep->out.len >= len)
+			break;
+		fifo_window_writer_wait(&ep->out);
+	}
+}
+
+int channel_send(struct channel_endpoint *ep, uint64_t id, uint32_t flags,
+		 const void *buf, unsigned len)
+{
+	struct channel_header hdr;
+	unsigned size = CHANNEL_MESSAGE_SIZE(len);
+
+	if (len > ep->out.size || size > ep->out.size)
+		return -EMSGSIZE;
+	reserve(ep, size);
+
+	hdr.len = len;
+	hdr.flags = flags;
+	hdr.id = id;
+	fifo_window_put(&ep->out, &hdr, sizeof(hdr));
+	fifo_window_put(&ep->out, buf, len);
+	fifo_window_eat_span(&ep->out, size - sizeof(hdr) - len);
+	ep->pending += size;
+	return 0;
+}
+
+int channel_call(struct channel_endpoint *ep, const void *buf, unsigned len, uint64_t *id)
+{
+	int rv;
+
+	*id = ep->next_id++;
+	rv = channel_send(ep, *id, 0, buf, len);
+	if (!rv)
+		channel_flush(ep);
+	return rv;
+}
+
+/* end of data seen by last exchange. Other side has published more
+ * when fifo head moves past it */
+static inline
+int in_moved(struct channel_endpoint *ep)
+{
+	return *(volatile unsigned *)&ep->in.fifo->head != ep->in.start + ep->in.len;
+}
+
+/* waits until reader window holds at least len bytes. Spinning only
+ * reads head, exchange (which writes tail) is done when it moved */
+static
+int wait_readable(struct channel_endpoint *ep, unsigned len)
+{
+	unsigned spins = 0;
+
+	while (ep->in.len < len) {
+		int closed = fifo_window_writer_closed(&ep->in);
+
+		fifo_window_exchange_reader(&ep->in);
+		if (ep->in.len >= len)
+			break;
+		if (closed)
+			return -EPIPE;
+		while (spins < ep->spin_count && !in_moved(ep)) {
+			cpu_relax();
+			spins++;
+		}
+		if (spins >= ep->spin_count)
+			fifo_window_reader_wait(&ep->in);
+	}
+	return 0;
+}
+
+int channel_recv(struct channel_endpoint *ep, struct channel_header *hdr,
+		 void *buf, unsigned buf_size)
+{
+	unsigned padding;
+	int rv;
+
+	rv = wait_readable(ep, sizeof(*hdr));
+	if (rv)
+		return rv;
+
+	/* messages are published whole, so payload is in window
+	 * already */
+	fifo_window_take(&ep->in, hdr, sizeof(*hdr));
+	padding = CHANNEL_MESSAGE_SIZE(hdr->len) - sizeof(*hdr) - hdr->len;
+	if (hdr->len > buf_size) {
+		fifo_window_eat_span(&ep->in, hdr->len + padding);
+		return -EMSGSIZE;
+	}
+	fifo_window_take(&ep->in, buf, hdr->len);
+	fifo_window_eat_span(&ep->in, padding);
+	return hdr->len;
+}
+
+int channel_readable(struct channel_endpoint *ep)
+{
+	int closed;
+
+	if (ep->in.len >= sizeof(struct channel_header))
+		return 1;
+	if (!in_moved(ep) && !fifo_window_writer_closed(&ep->in))
+		return 0;
+	closed = fifo_window_writer_closed(&ep->in);
+	fifo_window_exchange_reader(&ep->in);
+	return closed || ep->in.len >= sizeof(struct channel_header);
+}
+
+void channel_close(struct channel_endpoint *ep)
+{
+	fifo_window_close_writer(&ep->out);
+	ep->pending = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+#include <stdint.h>
+
+#include "fifo.h"
+
+/* duplex message channel built of request and response fifos. Every
+ * message is header followed by payload padded to CHANNEL_ALIGN
+ * bytes. Correlation id is chosen by client and echoed by server, so
+ * many requests may be outstanding and responses may come in any
+ * order */
+struct channel_header {
+	uint32_t len;		/* payload bytes, padding excluded */
+	uint32_t flags;		/* application defined */
+	uint64_t id;
+};
+
+#define CHANNEL_ALIGN 8
+#define CHANNEL_MESSAGE_SIZE(len) \
+	(sizeof(struct channel_header) + (((len) + CHANNEL_ALIGN - 1) & ~(CHANNEL_ALIGN - 1)))
+
+/* polls of incoming fifo before falling back to fifo_window_reader_wait
+ * (which spins fifo_spin_count more times and then sleeps). Tunable
+ * per endpoint via spin_count, zero on uniprocessor */
+#define CHANNEL_SPIN_COUNT 1024
+
+struct channel {
+	struct shm_fifo *request, *response;
+};
+
+/* one side of channel. Client writes requests and reads responses,
+ * server does the opposite */
+struct channel_endpoint {
+	struct fifo_window out, in;
+	unsigned spin_count;
+	uint64_t next_id;
+	/* bytes written but not yet published by channel_flush */
+	unsigned pending;
+};
+
+/* both fifos get size bytes (power of two). Returns 0 or errno */
+int channel_create(struct channel *ch, unsigned size);
+void channel_destroy(struct channel *ch);
+
+void channel_client_init(struct channel *ch, struct channel_endpoint *ep);
+void channel_server_init(struct channel *ch, struct channel_endpoint *ep);
+
+/* queues message. It's published on channel_flush or when outgoing
+ * fifo runs out of room, so that many messages (e.g. responses to
+ * batch of requests) are passed with single exchange and wakeup.
+ * Waits for room if needed. Returns 0 or -EMSGSIZE if message can't
+ * ever fit into fifo.
+ *
+ * Pipelined client must not queue more than fits into fifos without
+ * receiving responses, otherwise both sides may block on full
+ * fifos */
+int channel_send(struct channel_endpoint *ep, uint64_t id, uint32_t flags,
+		 const void *buf, unsigned len);
+void channel_flush(struct channel_endpoint *ep);
+
+/* sends request with next correlation id of endpoint (stored into
+ * *id) and flushes it. Returns as channel_send */
+int channel_call(struct channel_endpoint *ep, const void *buf, unsigned len, uint64_t *id);
+
+/* waits for next message (polling for a while before sleeping),
+ * fills header and copies payload into buf. Returns payload length,
+ * -EMSGSIZE if payload doesn't fit into buf_size (message is
+ * skipped, header is still filled) or -EPIPE when other side closed
+ * channel and all messages were received */
+int channel_recv(struct channel_endpoint *ep, struct channel_header *hdr,
+		 void *buf, unsigned buf_size);
+
+/* returns non-zero if channel_recv won't wait. Doesn't block */
+int channel_readable(struct channel_endpoint *ep);
+
+/* flushes and closes outgoing direction */
+void channel_close(struct channel_endpoint *ep);
+
+#endif
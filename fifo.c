@@ -6,14 +6,20 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <atomic_ops.h>
 #include <limits.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
 
 #include "fifo.h"
+#include "fifo_trace.h"
 
 #define likely(cond) __builtin_expect((cond), 1)
 #define unlikely(cond) __builtin_expect((cond), 0)
@@ -69,6 +75,22 @@ int eventfd(unsigned initval, int flags)
 
 #define SPIN_COUNT 256
 
+unsigned fifo_spin_count = SPIN_COUNT;
+
+/* global counters are shared by all fifos in process. Builds that run
+ * many fifo pairs at once disable them to avoid measuring false
+ * sharing of counters instead of fifo itself. Per-window counters
+ * (struct fifo_window_stats) are always maintained */
+#ifndef FIFO_GLOBAL_STATS
+#define FIFO_GLOBAL_STATS 1
+#endif
+
+#if FIFO_GLOBAL_STATS
+#define global_stat_add(var, n) ((var) += (n))
+#else
+#define global_stat_add(var, n) do {} while (0)
+#endif
+
 __attribute__((aligned(64)))
 int64_t fifo_reader_exchange_count;
 int64_t fifo_writer_wake_count;
@@ -80,17 +102,17 @@ int64_t fifo_writer_exchange_count;
 int64_t fifo_reader_wake_count;
 int64_t fifo_writer_wait_spins;
 int64_t fifo_writer_wait_calls;
+int64_t fifo_reader_dropped_bytes;
 
 #if USE_EVENTFD
 static __attribute__((unused))
 int file_flags_change(int fd, int and_mask, int or_mask)
 {
-	int flags;
-	int err = fcntl(fd, F_GETFL, (long)&flags);
-	if (err < 0)
-		return err;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return flags;
 	flags = (flags & and_mask) | or_mask;
-	return fcntl(fd, F_SETFL, (long) &flags);
+	return fcntl(fd, F_SETFL, flags);
 }
 
 #if USE_EVENTFD_EMULATION
@@ -142,40 +164,361 @@ void eventfd_release(struct shm_fifo_eventfd_storage *this)
 #endif /* !USE_EVENTFD_EMULATION */
 #endif /* USE_EVENTFD */
 
-int fifo_create(struct shm_fifo **ptr)
+/* wakeup state lives in process memory only (eventfds) and has to
+ * be created again when persistent fifo is reopened */
+static
+int init_wakeups(struct shm_fifo *fifo)
 {
-	int err = posix_memalign((void **)ptr, 4096, FIFO_TOTAL_SIZE);
-	struct shm_fifo *fifo = *ptr;
-	if (!err) {
-		memset(fifo, 0, offsetof(struct shm_fifo, data));
 #if USE_EVENTFD
-		int rv;
-		rv = eventfd_create(&fifo->head_eventfd);
-		if (rv)
-			goto out_free;
-		rv = eventfd_create(&fifo->tail_eventfd);
-		if (rv) {
-			eventfd_release(&fifo->head_eventfd);
-		out_free:
-			free(fifo);
-			return 0;
-		}
+	int err = eventfd_create(&fifo->head_eventfd);
+	if (err)
+		return errno ? errno : EMFILE;
+	err = eventfd_create(&fifo->tail_eventfd);
+	if (err) {
+		eventfd_release(&fifo->head_eventfd);
+		return errno ? errno : EMFILE;
+	}
 #else
-		fprintf(stderr, "fifo_create: using futex implementation\n");
+	fprintf(stderr, "fifo_create: using futex implementation\n");
 #endif // USE_EVENTFD
-	}
 	fifo->head_wait = fifo->tail_wait = 0xffffffff;
+	return 0;
+}
 
+static
+void release_wakeups(struct shm_fifo *fifo)
+{
+#if USE_EVENTFD
+	eventfd_release(&fifo->head_eventfd);
+	eventfd_release(&fifo->tail_eventfd);
+#endif
+}
+
+/* positions are free-running 32-bit counters, so size must divide
+ * 2^32 */
+static
+int valid_size(unsigned size)
+{
+	return size >= 64 && !(size & (size - 1));
+}
+
+/* raw syscall, so that libnuma isn't needed */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#endif
+#define FIFO_MAX_NODES 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* parses sysfs node list like "0-1,3" into mask. Returns 0 or -1 if
+ * there's no such file */
+static
+int read_node_list(const char *path, unsigned long *mask)
+{
+	FILE *f = fopen(path, "r");
+	int first, last, c;
+
+	if (!f)
+		return -1;
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (; first <= last && first < FIFO_MAX_NODES; first++)
+			mask[first / LONG_BITS] |= 1UL << (first % LONG_BITS);
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return 0;
+}
+
+int fifo_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *e;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((e = readdir(dir)))
+		if (!strncmp(e->d_name, "node", 4) && isdigit((unsigned char)e->d_name[4])) {
+			node = atoi(e->d_name + 4);
+			break;
+		}
+	closedir(dir);
+	return node;
+}
+
+/* must run before pages are touched, policy applies to pages as
+ * they're faulted in */
+static
+int place_memory(void *addr, size_t len, int numa_policy, int node)
+{
+	unsigned long mask[FIFO_MAX_NODES / LONG_BITS];
+	int mode;
+
+	memset(mask, 0, sizeof(mask));
+	switch (numa_policy) {
+	case FIFO_NUMA_DEFAULT:
+		return 0;
+	case FIFO_NUMA_NODE:
+		/* unknown node, e.g. cpu without node in sysfs */
+		if (node < 0)
+			return 0;
+		if (node >= FIFO_MAX_NODES)
+			return EINVAL;
+		mask[node / LONG_BITS] |= 1UL << (node % LONG_BITS);
+		mode = MPOL_PREFERRED;
+		break;
+	case FIFO_NUMA_INTERLEAVE:
+		if (read_node_list("/sys/devices/system/node/online", mask))
+			return 0;
+		mode = MPOL_INTERLEAVE;
+		break;
+	default:
+		return EINVAL;
+	}
+	if (syscall(__NR_mbind, addr, len, mode, mask, FIFO_MAX_NODES + 1, 0) < 0) {
+		/* kernel without NUMA: everything is local anyway */
+		if (errno == ENOSYS)
+			return 0;
+		return errno;
+	}
+	return 0;
+}
+
+int fifo_create_numa(struct shm_fifo **ptr, unsigned size, unsigned flags,
+		     int numa_policy, int node)
+{
+	struct shm_fifo *fifo;
+	size_t total = offsetof(struct shm_fifo, data) + size;
+	int err;
+
+	if (!valid_size(size) || (flags & FIFO_PERSISTENT))
+		return EINVAL;
+
+	/* untouched pages stay uncommitted until head gets to them */
+	fifo = mmap(0, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (fifo == MAP_FAILED) {
+		*ptr = 0;
+		return errno;
+	}
+	err = place_memory(fifo, total, numa_policy, node);
+	if (err) {
+		munmap(fifo, total);
+		*ptr = 0;
+		return err;
+	}
+
+	*ptr = fifo;
+	fifo->header_size = offsetof(struct shm_fifo, data);
+	fifo->size = size;
+	fifo->flags = flags;
+	err = init_wakeups(fifo);
+	if (err) {
+		munmap(fifo, total);
+		*ptr = 0;
+	}
 	return err;
 }
 
+int fifo_create_flags(struct shm_fifo **ptr, unsigned size, unsigned flags)
+{
+	return fifo_create_numa(ptr, size, flags, FIFO_NUMA_DEFAULT, -1);
+}
+
+/* checks header of existing ring file. Returns 0 or errno */
+static
+int check_persistent_header(int fd, off_t file_size, unsigned *size)
+{
+	struct shm_fifo header;
+
+	if (pread(fd, &header, offsetof(struct shm_fifo, head), 0) != offsetof(struct shm_fifo, head))
+		return EINVAL;
+	if (header.magic != FIFO_PERSIST_MAGIC || header.version != FIFO_PERSIST_VERSION ||
+	    header.header_size != offsetof(struct shm_fifo, data) ||
+	    !(header.flags & FIFO_PERSISTENT) || !valid_size(header.size))
+		return EINVAL;
+	if (*size && *size != header.size)
+		return EINVAL;
+	if (file_size != offsetof(struct shm_fifo, data) + header.size)
+		return EINVAL;
+	*size = header.size;
+	return 0;
+}
+
+int fifo_open_persistent(struct shm_fifo **ptr, const char *path,
+			 unsigned size, unsigned sync_bytes)
+{
+	struct shm_fifo *fifo;
+	struct stat st;
+	size_t total;
+	int fresh, fd, err;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st)) {
+		err = errno;
+		goto out_close;
+	}
+
+	fresh = (st.st_size == 0);
+	if (fresh) {
+		err = EINVAL;
+		if (!valid_size(size))
+			goto out_close;
+		if (ftruncate(fd, offsetof(struct shm_fifo, data) + size)) {
+			err = errno;
+			goto out_close;
+		}
+	} else {
+		err = check_persistent_header(fd, st.st_size, &size);
+		if (err)
+			goto out_close;
+	}
+
+	total = offsetof(struct shm_fifo, data) + size;
+	fifo = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fifo == MAP_FAILED) {
+		err = errno;
+		goto out_close;
+	}
+	close(fd);
+
+	if (fresh) {
+		fifo->magic = FIFO_PERSIST_MAGIC;
+		fifo->version = FIFO_PERSIST_VERSION;
+		fifo->header_size = offsetof(struct shm_fifo, data);
+		fifo->size = size;
+		fifo->flags = FIFO_PERSISTENT;
+		msync(fifo, offsetof(struct shm_fifo, data), MS_SYNC);
+	} else {
+		/* anything past durable_head might not reach disk before
+		 * crash */
+		fifo->head = fifo->durable_head;
+		if ((int)(fifo->tail - fifo->head) > 0)
+			fifo->tail = fifo->head;
+		/* writer died with window open, its unpublished bytes
+		 * overwrote history below tail */
+		if (fifo->writer_open) {
+			fifo->history_start = fifo->tail;
+			fifo->writer_open = 0;
+			msync(fifo, offsetof(struct shm_fifo, data), MS_SYNC);
+		}
+	}
+	fifo->sync_bytes = sync_bytes;
+	fifo->closed = 0;
+	fifo->reserve = 0;
+
+	err = init_wakeups(fifo);
+	if (err) {
+		munmap(fifo, total);
+		return err;
+	}
+	*ptr = fifo;
+	return 0;
+
+out_close:
+	close(fd);
+	return err;
+}
+
+int fifo_create_sized(struct shm_fifo **ptr, unsigned size)
+{
+	return fifo_create_flags(ptr, size, 0);
+}
+
+int fifo_create(struct shm_fifo **ptr)
+{
+	return fifo_create_sized(ptr, FIFO_SIZE);
+}
+
+static
+long page_size;
+
+/* durability points and reclaim are frequent, sysconf isn't needed
+ * every time */
+static
+long get_page_size(void)
+{
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+static
+void sync_data(struct shm_fifo *fifo, unsigned start, unsigned len)
+{
+	uintptr_t page_mask = get_page_size() - 1;
+	uintptr_t begin = (uintptr_t)&fifo->data[start];
+	uintptr_t end = begin + len;
+
+	begin &= ~page_mask;
+	if (msync((void *)begin, end - begin, MS_SYNC))
+		perror("fifo:msync");
+}
+
+/* durability point: data in [durable_head, head) is written to disk
+ * before durable_head is advanced, so that reopened fifo never sees
+ * data that didn't make it */
+static
+void persist_head(struct shm_fifo *fifo, unsigned head, int force)
+{
+	unsigned durable = fifo->durable_head;
+	unsigned len = head - durable;
+	unsigned mask = fifo->size - 1;
+	unsigned start;
+
+	if (!len || (!force && len < fifo->sync_bytes))
+		return;
+	if (len > fifo->size) {
+		durable = head - fifo->size;
+		len = fifo->size;
+	}
+	start = durable & mask;
+	if (start + len > fifo->size) {
+		sync_data(fifo, start, fifo->size - start);
+		sync_data(fifo, 0, start + len - fifo->size);
+	} else {
+		sync_data(fifo, start, len);
+	}
+	fifo->durable_head = head;
+	/* keeps it within reach of wrapping positions */
+	if ((int)(head - fifo->size - fifo->history_start) > 0)
+		fifo->history_start = head - fifo->size;
+	msync(fifo, offsetof(struct shm_fifo, data), MS_ASYNC);
+}
+
+void fifo_destroy(struct shm_fifo *fifo)
+{
+	release_wakeups(fifo);
+	if (fifo->flags & FIFO_PERSISTENT)
+		persist_head(fifo, fifo->head, 1);
+	munmap(fifo, offsetof(struct shm_fifo, data) + fifo->size);
+}
+
 static
 int common_fifo_window_init(struct shm_fifo *fifo, struct fifo_window *window,
 			    unsigned min_length, unsigned pull_length, int reader)
 {
 	window->fifo = fifo;
+	window->size = fifo->size;
+	window->flags = fifo->flags;
 	window->reader = reader;
 	window->len = 0;
+	window->idle_pos = 0;
+	window->idle_reclaimed = 0;
+	window->idle_since = 0;
+	memset(&window->stats, 0, sizeof(window->stats));
 	if (min_length > pull_length)
 		pull_length = min_length;
 	window->min_length = min_length;
@@ -186,14 +529,19 @@ int common_fifo_window_init(struct shm_fifo *fifo, struct fifo_window *window,
 int fifo_window_init_reader(struct shm_fifo *fifo, struct fifo_window *window,
 			    unsigned min_length, unsigned pull_length)
 {
-	window->start = fifo->tail % FIFO_SIZE;
+	window->start = fifo->tail;
 	return common_fifo_window_init(fifo, window, min_length, pull_length, 1);
 }
 
 int fifo_window_init_writer(struct shm_fifo *fifo, struct fifo_window *window,
 			    unsigned min_length, unsigned pull_length)
 {
-	window->start = fifo->head % FIFO_SIZE;
+	window->start = fifo->head;
+	/* on disk before any byte of history can be overwritten */
+	if ((fifo->flags & FIFO_PERSISTENT) && !fifo->writer_open) {
+		fifo->writer_open = 1;
+		msync(fifo, offsetof(struct shm_fifo, data), MS_SYNC);
+	}
 	return common_fifo_window_init(fifo, window, min_length, pull_length, 0);
 }
 
@@ -286,6 +634,7 @@ void futex_wake(void *addr)
 void fifo_window_reader_wait(struct fifo_window *window)
 {
 	struct shm_fifo *fifo = window->fifo;
+	unsigned spin_count = fifo_spin_count;
 	unsigned count;
 	unsigned tail;
 	unsigned head;
@@ -298,31 +647,41 @@ void fifo_window_reader_wait(struct fifo_window *window)
 	if (head - tail != window->len)
 		return;
 
-	fifo_reader_wait_calls++;
+	global_stat_add(fifo_reader_wait_calls, 1);
+	window->stats.wait_calls++;
 
-	for (count = SPIN_COUNT; count > 0; count--) {
+	for (count = spin_count; count > 0; count--) {
 		AO_nop_full();
 		if (fifo->head != head) {
-			fifo_reader_wait_spins += SPIN_COUNT - count + 1;
+			global_stat_add(fifo_reader_wait_spins, spin_count - count + 1);
+			window->stats.wait_spins += spin_count - count + 1;
+			fifo_trace(FIFO_TRACE_SPIN_EXIT, fifo, 1, spin_count - count + 1);
 			return;
 		}
 	}
 
-	fifo_reader_wait_spins += SPIN_COUNT - count;
+	global_stat_add(fifo_reader_wait_spins, spin_count - count);
+	window->stats.wait_spins += spin_count - count;
 
 	fifo->head_wait = head;
+	AO_nop_full();
+	if (fifo->closed)
+		return;
+	fifo_trace(FIFO_TRACE_SLEEP, fifo, 1, window->len);
 	do {
 #if USE_EVENTFD
 		eventfd_wait(&fifo->head_eventfd, &fifo->head, head);
 #else
 		futex_wait(&fifo->head, head);
 #endif
-	} while (head == fifo->head);
+	} while (head == fifo->head && !fifo->closed);
+	fifo_trace(FIFO_TRACE_WAKE_RECEIVED, fifo, 1, fifo->head - tail);
 }
 
 void fifo_window_writer_wait(struct fifo_window *window)
 {
 	struct shm_fifo *fifo = window->fifo;
+	unsigned spin_count = fifo_spin_count;
 	unsigned count;
 	unsigned tail;
 	unsigned head;
@@ -332,20 +691,25 @@ void fifo_window_writer_wait(struct fifo_window *window)
 
 	tail = fifo->tail;
 	head = fifo->head;
-	if (tail + FIFO_SIZE - head != window->len)
+	if (tail + window->size - head != window->len)
 		return;
 
-	fifo_writer_wait_calls++;
+	global_stat_add(fifo_writer_wait_calls, 1);
+	window->stats.wait_calls++;
 
-	for (count = SPIN_COUNT; count > 0; count--) {
+	for (count = spin_count; count > 0; count--) {
 		AO_nop_full();
 		if (fifo->tail != tail) {
-			fifo_writer_wait_spins += SPIN_COUNT - count + 1;
+			global_stat_add(fifo_writer_wait_spins, spin_count - count + 1);
+			window->stats.wait_spins += spin_count - count + 1;
+			fifo_trace(FIFO_TRACE_SPIN_EXIT, fifo, 0, spin_count - count + 1);
 			return;
 		}
 	}
-	fifo_writer_wait_spins += SPIN_COUNT - count;
+	global_stat_add(fifo_writer_wait_spins, spin_count - count);
+	window->stats.wait_spins += spin_count - count;
 	fifo->tail_wait = tail;
+	fifo_trace(FIFO_TRACE_SLEEP, fifo, 0, window->len);
 	do {
 #if USE_EVENTFD
 		eventfd_wait(&fifo->tail_eventfd, &fifo->tail, tail);
@@ -353,14 +717,121 @@ void fifo_window_writer_wait(struct fifo_window *window)
 		futex_wait(&fifo->tail, tail);
 #endif
 	} while (tail == fifo->tail);
+	fifo_trace(FIFO_TRACE_WAKE_RECEIVED, fifo, 0, fifo->tail + window->size - head);
+}
+
+#if USE_EVENTFD
+int fifo_window_reader_arm(struct fifo_window *window, int *fd)
+{
+	struct shm_fifo *fifo = window->fifo;
+	unsigned spin_count = fifo_spin_count;
+	unsigned count;
+	unsigned head;
+
+	if (!window->reader)
+		abort();
+
+	head = fifo->head;
+	if (head - fifo->tail != window->len || fifo->closed)
+		return 1;
+	global_stat_add(fifo_reader_wait_calls, 1);
+	window->stats.wait_calls++;
+	for (count = spin_count; count > 0; count--) {
+		AO_nop_full();
+		if (fifo->head != head) {
+			global_stat_add(fifo_reader_wait_spins, spin_count - count + 1);
+			window->stats.wait_spins += spin_count - count + 1;
+			fifo_trace(FIFO_TRACE_SPIN_EXIT, fifo, 1, spin_count - count + 1);
+			return 1;
+		}
+	}
+	global_stat_add(fifo_reader_wait_spins, spin_count - count);
+	window->stats.wait_spins += spin_count - count;
+
+	fifo->head_wait = head;
+	AO_nop_full();
+	if (fifo->head != head || fifo->closed)
+		return 1;
+	fifo_trace(FIFO_TRACE_SLEEP, fifo, 1, window->len);
+	*fd = fifo->head_eventfd.fd;
+	return 0;
 }
 
+int fifo_window_writer_arm(struct fifo_window *window, int *fd)
+{
+	struct shm_fifo *fifo = window->fifo;
+	unsigned spin_count = fifo_spin_count;
+	unsigned count;
+	unsigned tail;
+
+	if (window->reader)
+		abort();
+
+	tail = fifo->tail;
+	if (tail + window->size - fifo->head != window->len)
+		return 1;
+	global_stat_add(fifo_writer_wait_calls, 1);
+	window->stats.wait_calls++;
+	for (count = spin_count; count > 0; count--) {
+		AO_nop_full();
+		if (fifo->tail != tail) {
+			global_stat_add(fifo_writer_wait_spins, spin_count - count + 1);
+			window->stats.wait_spins += spin_count - count + 1;
+			fifo_trace(FIFO_TRACE_SPIN_EXIT, fifo, 0, spin_count - count + 1);
+			return 1;
+		}
+	}
+	global_stat_add(fifo_writer_wait_spins, spin_count - count);
+	window->stats.wait_spins += spin_count - count;
+
+	fifo->tail_wait = tail;
+	AO_nop_full();
+	if (fifo->tail != tail)
+		return 1;
+	fifo_trace(FIFO_TRACE_SLEEP, fifo, 0, window->len);
+	*fd = fifo->tail_eventfd.fd;
+	return 0;
+}
+
+void fifo_window_wakeup_ack(struct fifo_window *window)
+{
+	struct shm_fifo *fifo = window->fifo;
+	struct shm_fifo_eventfd_storage *eventfd =
+		window->reader ? &fifo->head_eventfd : &fifo->tail_eventfd;
+	/* pipe emulation may hold several wakeups */
+	eventfd_t buf[8];
+
+	while (read(eventfd->fd, buf, sizeof(buf)) < 0 && errno == EINTR)
+		;
+	fifo_trace(FIFO_TRACE_WAKE_RECEIVED, fifo, window->reader, window->len);
+}
+
+#else /* !USE_EVENTFD */
+/* futex has nothing to poll */
+int fifo_window_reader_arm(struct fifo_window *window, int *fd)
+{
+	return ENOTSUP;
+}
+
+int fifo_window_writer_arm(struct fifo_window *window, int *fd)
+{
+	return ENOTSUP;
+}
+
+void fifo_window_wakeup_ack(struct fifo_window *window)
+{
+}
+#endif
+
 static
-void shm_fifo_notify_reader(struct shm_fifo *fifo, unsigned old_head)
+void shm_fifo_notify_reader(struct fifo_window *window, unsigned old_head)
 {
+	struct shm_fifo *fifo = window->fifo;
 	AO_nop_full();
 	if (fifo->head_wait == old_head) {
-		fifo_reader_wake_count++;
+		global_stat_add(fifo_reader_wake_count, 1);
+		window->stats.wake_count++;
+		fifo_trace(FIFO_TRACE_WAKE_SENT, fifo, window->reader, window->len);
 #if USE_EVENTFD
 		eventfd_wake(&fifo->head_eventfd);
 #else
@@ -370,11 +841,14 @@ void shm_fifo_notify_reader(struct shm_fifo *fifo, unsigned old_head)
 }
 
 static
-void shm_fifo_notify_writer(struct shm_fifo *fifo, unsigned old_tail)
+void shm_fifo_notify_writer(struct fifo_window *window, unsigned old_tail)
 {
+	struct shm_fifo *fifo = window->fifo;
 	AO_nop_full();
 	if (fifo->tail_wait == old_tail) {
-		fifo_writer_wake_count++;
+		global_stat_add(fifo_writer_wake_count, 1);
+		window->stats.wake_count++;
+		fifo_trace(FIFO_TRACE_WAKE_SENT, fifo, window->reader, window->len);
 #if USE_EVENTFD
 		eventfd_wake(&fifo->tail_eventfd);
 #else
@@ -395,17 +869,122 @@ unsigned check_window_free_count(struct fifo_window *window, unsigned old_start,
 {
 	unsigned start = window->start;
 	unsigned free_count = start - old_start;
-	if (unlikely(free_count > FIFO_SIZE)) {
+	if (unlikely(free_count > window->size)) {
 		fifo_notify_invalid_window(window, reader);
 		abort();
 	}
 	return free_count;
 }
 
+void fifo_window_persist(struct fifo_window *window)
+{
+	if (window->flags & FIFO_PERSISTENT)
+		persist_head(window->fifo, window->fifo->head, 1);
+}
+
+/* never 0, which marks idle time as not tracked */
+static
+int64_t coarse_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + 1;
+}
+
+unsigned fifo_window_reclaim_idle(struct fifo_window *window, unsigned quiet_ms, int lazy)
+{
+	struct shm_fifo *fifo = window->fifo;
+	uintptr_t start, end;
+	unsigned head, tail;
+	int64_t now;
+	long page = get_page_size();
+	int advice = MADV_DONTNEED;
+
+	if (window->reader)
+		abort();
+	if (window->flags & (FIFO_LOSSY | FIFO_PERSISTENT))
+		return 0;
+
+	/* only writer writes data, and we're writer. With everything
+	 * published and consumed no one else touches data area */
+	head = fifo->head;
+	tail = *(volatile unsigned *)&fifo->tail;
+	if (tail != head || window->start != head) {
+		window->idle_since = 0;
+		return 0;
+	}
+	now = coarse_ms();
+	if (!window->idle_since || window->idle_pos != head) {
+		window->idle_pos = head;
+		window->idle_since = now;
+		window->idle_reclaimed = 0;
+		return 0;
+	}
+	if (window->idle_reclaimed || now - window->idle_since < quiet_ms)
+		return 0;
+	window->idle_reclaimed = 1;
+
+	start = ((uintptr_t)fifo->data + page - 1) & ~(uintptr_t)(page - 1);
+	end = ((uintptr_t)fifo->data + fifo->size) & ~(uintptr_t)(page - 1);
+	if (end <= start)
+		return 0;
+#ifdef MADV_FREE
+	if (lazy)
+		advice = MADV_FREE;
+#endif
+	if (madvise((void *)start, end - start, advice) < 0 &&
+	    (advice == MADV_DONTNEED || madvise((void *)start, end - start, MADV_DONTNEED) < 0))
+		return 0;
+	window->stats.reclaimed_bytes += end - start;
+	return end - start;
+}
+
+/* writer doesn't look at tail, so reader just moves tail past data
+ * that writer could have overwritten */
+static
+void lossy_exchange_reader(struct fifo_window *window)
+{
+	struct shm_fifo *fifo = window->fifo;
+	unsigned tail = fifo->tail;
+	unsigned head, oldest;
+
+	tail += check_window_free_count(window, tail, 1);
+	head = fifo->head;
+	AO_nop_full();
+	oldest = fifo->reserve - window->size;
+	if ((int)(oldest - tail) > 0) {
+		global_stat_add(fifo_reader_dropped_bytes, oldest - tail);
+		window->stats.dropped_bytes += oldest - tail;
+		tail = oldest;
+	}
+	fifo->tail = tail;
+	window->start = tail;
+	/* writer may lap us between reads of head and reserve */
+	window->len = (int)(head - tail) > 0 ? head - tail : 0;
+
+	global_stat_add(fifo_reader_exchange_count, 1);
+	window->stats.exchange_count++;
+	fifo_trace(FIFO_TRACE_EXCHANGE, fifo, 1, window->len);
+}
+
+/* min_length can't be waited for past end of stream: once writer
+ * closed fifo, tail of stream is returned however short it is.
+ * closed is read before head, so head is final then */
 void fifo_window_exchange_reader(struct fifo_window *window)
 {
 	unsigned len;
+	int closed;
+	if (window->flags & FIFO_LOSSY) {
+		while (1) {
+			closed = fifo_window_writer_closed(window);
+			lossy_exchange_reader(window);
+			if (window->len >= window->min_length || closed)
+				return;
+			fifo_window_reader_wait(window);
+		}
+	}
 again:
+	closed = fifo_window_writer_closed(window);
 	len = window->len;
 	struct shm_fifo *fifo = window->fifo;
 	unsigned tail = fifo->tail;
@@ -419,26 +998,53 @@ again:
 	if (len < window->pull_length)
 		len = window->len = fifo->head - tail;
 
-	if (len > FIFO_SIZE) {
+	if (len > window->size) {
 		fifo_notify_invalid_window(window, 1);
 		fifo->tail = fifo->head;
 		window->len = 0;
-		window->start = tail % FIFO_SIZE;
+		window->start = fifo->tail;
 	}
 
-	shm_fifo_notify_writer(fifo, old_tail);
+	shm_fifo_notify_writer(window, old_tail);
 
-	if (unlikely(len < window->min_length)) {
+	if (unlikely(len < window->min_length) && !closed) {
 		fifo_window_reader_wait(window);
 		goto again;
 	}
 
-	fifo_reader_exchange_count++;
+	global_stat_add(fifo_reader_exchange_count, 1);
+	window->stats.exchange_count++;
+	fifo_trace(FIFO_TRACE_EXCHANGE, fifo, 1, window->len);
+}
+
+/* writer window is always size/2, reservation is published before
+ * any data in it is written. Cost doesn't depend on reader at all */
+static
+void lossy_exchange_writer(struct fifo_window *window)
+{
+	struct shm_fifo *fifo = window->fifo;
+	unsigned head = fifo->head;
+	unsigned old_head = head;
+
+	head += check_window_free_count(window, head, 0);
+	window->start = head;
+	window->len = window->size / 2;
+	fifo->reserve = head + window->len;
+	fifo->head = head;
+	shm_fifo_notify_reader(window, old_head);
+
+	global_stat_add(fifo_writer_exchange_count, 1);
+	window->stats.exchange_count++;
+	fifo_trace(FIFO_TRACE_EXCHANGE, fifo, 0, window->len);
 }
 
 void fifo_window_exchange_writer(struct fifo_window *window)
 {
 	unsigned len;
+	if (window->flags & FIFO_LOSSY) {
+		lossy_exchange_writer(window);
+		return;
+	}
 again:
 	len = window->len;
 	struct shm_fifo *fifo = window->fifo;
@@ -451,21 +1057,65 @@ again:
 	window->start = head;
 
 	if (len < window->pull_length)
-		len = window->len = fifo->tail + FIFO_SIZE - head;
+		len = window->len = fifo->tail + window->size - head;
 
-	if (len > FIFO_SIZE) {
+	if (len > window->size) {
 		fifo_notify_invalid_window(window, 0);
 		fifo->head = fifo->tail;
-		window->len = FIFO_SIZE;
-		window->start = head % FIFO_SIZE;
+		window->len = window->size;
+		window->start = fifo->head;
 	}
 
-	shm_fifo_notify_reader(fifo, old_head);
+	shm_fifo_notify_reader(window, old_head);
+
+	if (unlikely(window->flags & FIFO_PERSISTENT))
+		persist_head(fifo, head, 0);
 
 	if (unlikely(len < window->min_length)) {
 		fifo_window_writer_wait(window);
 		goto again;
 	}
 
-	fifo_writer_exchange_count++;
+	global_stat_add(fifo_writer_exchange_count, 1);
+	window->stats.exchange_count++;
+	fifo_trace(FIFO_TRACE_EXCHANGE, fifo, 0, window->len);
+}
+
+void fifo_window_close_writer(struct fifo_window *window)
+{
+	struct shm_fifo *fifo = window->fifo;
+
+	window->min_length = 0;
+	fifo_window_exchange_writer(window);
+	fifo_window_persist(window);
+	if (window->flags & FIFO_PERSISTENT) {
+		fifo->writer_open = 0;
+		msync(fifo, offsetof(struct shm_fifo, data), MS_ASYNC);
+	}
+	fifo->closed = 1;
+	shm_fifo_notify_reader(window, fifo->head);
+}
+
+int fifo_window_overrun(struct fifo_window *window)
+{
+	struct shm_fifo *fifo = window->fifo;
+	unsigned oldest;
+
+	if (!(window->flags & FIFO_LOSSY))
+		return 0;
+	/* orders reads of data before read of reserve */
+	AO_nop_full();
+	oldest = fifo->reserve - window->size;
+	if ((int)(oldest - fifo->tail) <= 0)
+		return 0;
+	global_stat_add(fifo_reader_dropped_bytes, window->start - fifo->tail);
+	window->stats.dropped_bytes += window->start - fifo->tail;
+	return 1;
+}
+
+int fifo_window_writer_closed(struct fifo_window *window)
+{
+	int closed = window->fifo->closed;
+	AO_nop_full();
+	return closed;
 }
@@ -1,6 +1,7 @@
 #ifndef SHM_FIFO_H
 #define SHM_FIFO_H
 #include <stdint.h>
+#include <string.h>
 
 struct shm_fifo_eventfd_storage {
 	int fd;
@@ -8,8 +9,32 @@ struct shm_fifo_eventfd_storage {
 };
 
 struct shm_fifo {
+	/* set by fifo_create and never changed afterwards. For
+	 * FIFO_PERSISTENT fifo this is on-disk header too */
+	uint32_t magic;
+	uint32_t version;
+	unsigned header_size;	/* offset of data */
+	unsigned size;
+	unsigned flags;
+	unsigned sync_bytes;	/* FIFO_PERSISTENT durability batch */
+
+	__attribute__((aligned(128)))
 	unsigned head;
 	unsigned head_wait;
+	unsigned closed;
+	/* FIFO_LOSSY only: end of writer window. Stored before writer
+	 * touches data below it, so data older than reserve - size may
+	 * be overwritten */
+	unsigned reserve;
+	/* FIFO_PERSISTENT only: data below it was msync-ed. Reopened
+	 * fifo resumes from it */
+	unsigned durable_head;
+	/* FIFO_PERSISTENT only: writer window is open, so data area
+	 * past head (history older than tail) may hold new bytes */
+	unsigned writer_open;
+	/* FIFO_PERSISTENT only: history below it was lost to writer
+	 * that didn't close fifo */
+	unsigned history_start;
 	struct shm_fifo_eventfd_storage head_eventfd;
 
 	__attribute__((aligned(128)))
@@ -21,6 +46,16 @@ struct shm_fifo {
 	char data[0];
 };
 
+/* per-window event counters */
+struct fifo_window_stats {
+	int64_t exchange_count;
+	int64_t wake_count;	/* wakeups sent to other side */
+	int64_t wait_spins;
+	int64_t wait_calls;
+	int64_t dropped_bytes;	/* reader only, FIFO_LOSSY */
+	int64_t reclaimed_bytes;	/* writer only, idle reclaim */
+};
+
 /* fifo_window reflects portion of fifo currently owned by reader or
  * writer. Start of window can be advanced by fifo_window_eat_span
  * (but note it won't be passed to reader/writer until next exchange
@@ -29,10 +64,21 @@ struct shm_fifo {
 struct fifo_window {
 	struct shm_fifo *fifo;
 	unsigned start, len;
+	unsigned size;		/* copy of fifo->size */
+	unsigned flags;		/* copy of fifo->flags */
 	unsigned min_length, pull_length;
 	int reader;
+	/* idle reclaim: position fifo rests at since idle_since (ms,
+	 * 0 when not tracked) */
+	unsigned idle_pos;
+	int idle_reclaimed;
+	int64_t idle_since;
+	/* same events as global fifo_*_count counters, but private to
+	 * window and thus free of cross-thread cache traffic */
+	struct fifo_window_stats stats;
 };
 
+/* default size used by fifo_create */
 #define FIFO_TOTAL_SIZE (65536+sizeof(struct shm_fifo))
 
 #define FIFO_SIZE (FIFO_TOTAL_SIZE-sizeof(struct shm_fifo))
@@ -42,12 +88,13 @@ struct fifo_window {
 static inline
 void *fifo_window_peek_span(struct fifo_window *window, unsigned *span_len)
 {
-	unsigned start = window->start % FIFO_SIZE;
+	unsigned size = window->size;
+	unsigned start = window->start & (size - 1);
 	char *p = &(window->fifo->data[start]);
 	if (span_len) {
 		unsigned len = window->len;
 		unsigned end = start + len;
-		end = (end > FIFO_SIZE) ? FIFO_SIZE : end;
+		end = (end > size) ? size : end;
 		len = end - start;
 		*span_len = len;
 	}
@@ -82,6 +129,42 @@ void *fifo_window_get_span(struct fifo_window *window, unsigned *span_len)
 	return rv;
 }
 
+/* copies len bytes into writer window, wrapping around end of fifo
+ * if needed. Window must have at least len bytes */
+static inline
+void fifo_window_put(struct fifo_window *window, const void *buf, unsigned len)
+{
+	const char *src = (const char *)buf;
+	while (len) {
+		unsigned span_len;
+		void *p = fifo_window_peek_span(window, &span_len);
+		if (span_len > len)
+			span_len = len;
+		memcpy(p, src, span_len);
+		fifo_window_eat_span(window, span_len);
+		src += span_len;
+		len -= span_len;
+	}
+}
+
+/* copies len bytes out of reader window. Window must have at least
+ * len bytes */
+static inline
+void fifo_window_take(struct fifo_window *window, void *buf, unsigned len)
+{
+	char *dst = (char *)buf;
+	while (len) {
+		unsigned span_len;
+		void *p = fifo_window_peek_span(window, &span_len);
+		if (span_len > len)
+			span_len = len;
+		memcpy(dst, p, span_len);
+		fifo_window_eat_span(window, span_len);
+		dst += span_len;
+		len -= span_len;
+	}
+}
+
 extern int64_t fifo_reader_exchange_count;
 extern int64_t fifo_writer_exchange_count;
 extern int64_t fifo_reader_wake_count;
@@ -90,11 +173,67 @@ extern int64_t fifo_reader_wait_spins;
 extern int64_t fifo_writer_wait_spins;
 extern int64_t fifo_reader_wait_calls;
 extern int64_t fifo_writer_wait_calls;
+extern int64_t fifo_reader_dropped_bytes;
+
+extern unsigned fifo_spin_count;
 
 int fifo_create(struct shm_fifo **ptr);
+/* size must be power of two. Returns 0 or errno value. Data area is
+ * anonymous mapping, so its pages are committed only when writer
+ * first reaches them */
+int fifo_create_sized(struct shm_fifo **ptr, unsigned size);
+
+/* lossy ring: writer never waits. Its window is always size/2 bytes
+ * ahead of head and overwrites oldest unread data. Reader exchange
+ * skips overwritten data and counts it in dropped_bytes. As writer
+ * may overwrite data while reader processes it, reader must check
+ * fifo_window_overrun after processing */
+#define FIFO_LOSSY 1
+
+int fifo_create_flags(struct shm_fifo **ptr, unsigned size, unsigned flags);
+
+/* NUMA placement of fifo memory. Default is first touch: pages land
+ * on node of whoever writes them first, which for data is writer.
+ * FIFO_NUMA_NODE prefers given node (e.g. fifo_cpu_node of reader's
+ * cpu, so that reader's misses stay local and writer's stores cross
+ * interconnect instead), node < 0 means default. FIFO_NUMA_INTERLEAVE
+ * spreads pages over all online nodes. Placement is per page and
+ * head and tail lines share first page with start of data, so they
+ * follow data policy too; each side keeps its own line in cache
+ * while it's busy, home node matters only for misses. Returns 0 or
+ * errno; kernels without NUMA support just get default placement */
+#define FIFO_NUMA_DEFAULT 0
+#define FIFO_NUMA_NODE 1
+#define FIFO_NUMA_INTERLEAVE 2
+
+int fifo_create_numa(struct shm_fifo **ptr, unsigned size, unsigned flags,
+		     int numa_policy, int node);
+
+/* node of cpu from sysfs or -1 */
+int fifo_cpu_node(int cpu);
+
+/* fifo mmap-ed from file, so that published data survives crash of
+ * either side. Writer exchange msyncs data once at least sync_bytes
+ * were published since last durability point and advances
+ * durable_head. Tail is persisted lazily (by page cache), so
+ * restarted reader may see some data again. Existing file is
+ * reopened (size 0 means take it from header): head is rolled back to
+ * durable_head and wakeup state is reset. Data older than tail
+ * (history) stays intact only if writer closed its window with
+ * fifo_window_close_writer; otherwise reopen moves history_start up
+ * to tail. Returns 0 or errno. Release with fifo_destroy, which
+ * makes final durability point */
+#define FIFO_PERSISTENT 2
+#define FIFO_PERSIST_MAGIC 0x4f464946	/* "FIFO" */
+#define FIFO_PERSIST_VERSION 2
+
+int fifo_open_persistent(struct shm_fifo **ptr, const char *path,
+			 unsigned size, unsigned sync_bytes);
+void fifo_destroy(struct shm_fifo *fifo);
 
 /* inits window. min_length arg is size of window below which it'll
- * automatically wait for more in exchange call. pull_length arg is
+ * automatically wait for more in exchange call (reader stops waiting
+ * once writer closed fifo, so last window may be shorter). pull_length arg is
  * size of window below which it'll attempt to grab all available
  * data/free-space in exchange call */
 int fifo_window_init_reader(struct shm_fifo *fifo,
@@ -113,6 +252,17 @@ int fifo_window_init_writer(struct shm_fifo *fifo,
 void fifo_window_reader_wait(struct fifo_window *window);
 void fifo_window_writer_wait(struct fifo_window *window);
 
+/* non-blocking counterparts of waits above for event loops. Spin
+ * like wait and then, if other side still didn't move, register
+ * waiter and set *fd to descriptor which becomes readable when it
+ * does. Return 0 when armed, 1 when window can progress already (so
+ * caller should exchange instead of waiting) and ENOTSUP for futex
+ * builds, which have no descriptor. After *fd got readable, call
+ * fifo_window_wakeup_ack and exchange; wakeups may be spurious */
+int fifo_window_reader_arm(struct fifo_window *window, int *fd);
+int fifo_window_writer_arm(struct fifo_window *window, int *fd);
+void fifo_window_wakeup_ack(struct fifo_window *window);
+
 /* releases "eaten" (i.e. consumed by consumer or produced by
  * producer) portion of window back to fifo and (depending on window
  * pull_length and min_length options) gets fresh data/free-space from
@@ -120,6 +270,32 @@ void fifo_window_writer_wait(struct fifo_window *window);
 void fifo_window_exchange_writer(struct fifo_window *window);
 void fifo_window_exchange_reader(struct fifo_window *window);
 
+/* marks end of stream. Data produced so far is published and waiting
+ * reader is woken. Reader should test fifo_window_writer_closed
+ * before exchange and stop only when window is still empty after
+ * it */
+void fifo_window_close_writer(struct fifo_window *window);
+int fifo_window_writer_closed(struct fifo_window *window);
+
+/* FIFO_LOSSY reader: returns non-zero if data eaten since last
+ * exchange may have been overwritten while it was read. Such data
+ * is counted as dropped and results computed from it should be
+ * discarded. Always 0 for regular fifo */
+int fifo_window_overrun(struct fifo_window *window);
+
+/* FIFO_PERSISTENT writer: makes data published so far durable now,
+ * regardless of sync_bytes */
+void fifo_window_persist(struct fifo_window *window);
+
+/* writer side idle memory release, called by writer thread when it
+ * has nothing to send. Once fifo is fully consumed, nothing is
+ * pending in window and positions didn't move for quiet_ms, data
+ * pages are given back to kernel with MADV_DONTNEED (MADV_FREE if
+ * lazy is set, which keeps them until memory pressure). Next write
+ * faults them in zeroed. Does nothing for lossy and persistent fifos.
+ * Returns bytes released */
+unsigned fifo_window_reclaim_idle(struct fifo_window *window, unsigned quiet_ms, int lazy);
+
 extern char *fifo_implementation_type;
 
 #endif
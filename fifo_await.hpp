@@ -0,0 +1,245 @@
+#ifndef SHM_FIFO_AWAIT_HPP
+#define SHM_FIFO_AWAIT_HPP
+// C++20 coroutine interface for fifo windows. Instead of parking
+// thread in fifo_window_{reader,writer}_wait, awaiting coroutine is
+// suspended and fifo wakeup descriptor (see fifo_window_reader_arm)
+// is handed to epoll executor, which resumes it once window is ready.
+// That lets many fifo-driven tasks share few threads. Futex builds
+// have no descriptor to poll and fall back to blocking wait.
+//
+// Executor is single-threaded: run one per thread, every fifo end
+// belongs to one of them.
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+extern "C" {
+#include "fifo.h"
+}
+
+namespace fifo_await {
+
+class executor;
+
+// coroutine waiting for window, lives in its frame while suspended
+struct waiter {
+	executor *exec;
+	std::coroutine_handle<> handle;
+	struct fifo_window *window;
+	unsigned min_bytes;
+
+	// exchanges window, true if coroutine can go on
+	bool ready()
+	{
+		if (window->reader) {
+			int closed = fifo_window_writer_closed(window);
+			fifo_window_exchange_reader(window);
+			return window->len >= min_bytes || closed;
+		}
+		fifo_window_exchange_writer(window);
+		return window->len >= min_bytes;
+	}
+
+	int arm(int *fd)
+	{
+		return window->reader ? fifo_window_reader_arm(window, fd) :
+			fifo_window_writer_arm(window, fd);
+	}
+
+	void block()
+	{
+		if (window->reader)
+			fifo_window_reader_wait(window);
+		else
+			fifo_window_writer_wait(window);
+	}
+};
+
+// detached coroutine started by executor::spawn. Frame is freed when
+// it finishes
+struct task {
+	struct promise_type {
+		executor *exec = nullptr;
+
+		~promise_type();
+		task get_return_object()
+		{
+			return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+class executor {
+public:
+	executor() : epfd(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (epfd < 0)
+			throw std::system_error(errno, std::system_category(), "epoll_create1");
+	}
+	~executor() { close(epfd); }
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	void spawn(task t)
+	{
+		t.handle.promise().exec = this;
+		live++;
+		ready_queue.push_back(t.handle);
+	}
+
+	// runs until all spawned tasks finished
+	void run()
+	{
+		struct epoll_event events[64];
+
+		while (live) {
+			while (!ready_queue.empty()) {
+				std::coroutine_handle<> h = ready_queue.front();
+				ready_queue.pop_front();
+				h.resume();
+			}
+			if (!live)
+				break;
+			if (!watching)
+				throw std::logic_error("fifo_await: tasks wait for nothing");
+			int n = epoll_wait(epfd, events, 64, -1);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::system_category(), "epoll_wait");
+			}
+			for (int i = 0; i < n; i++) {
+				waiter *w = static_cast<waiter *>(events[i].data.ptr);
+				watching--;
+				wakeups++;
+				fifo_window_wakeup_ack(w->window);
+				if (!wait(w))
+					ready_queue.push_back(w->handle);
+			}
+		}
+	}
+
+	// spins, then registers w. Returns false if it's ready right
+	// away, so coroutine doesn't have to be suspended
+	bool wait(waiter *w)
+	{
+		while (!w->ready()) {
+			int fd;
+			int rv = w->arm(&fd);
+			if (rv == 1)
+				continue;
+			if (rv) {
+				w->block();
+				continue;
+			}
+			watch(fd, w);
+			return true;
+		}
+		return false;
+	}
+
+	unsigned long long wakeups = 0;
+
+private:
+	friend struct task::promise_type;
+
+	// one-shot, so that fd needs no removal once coroutine is
+	// resumed. It stays registered until fifo closes it
+	void watch(int fd, waiter *w)
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = w;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+		    (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+			throw std::system_error(errno, std::system_category(), "epoll_ctl");
+		watching++;
+	}
+
+	int epfd;
+	std::deque<std::coroutine_handle<>> ready_queue;
+	unsigned live = 0;
+	unsigned watching = 0;
+};
+
+inline task::promise_type::~promise_type()
+{
+	if (exec)
+		exec->live--;
+}
+
+// co_await resumes coroutine with exchanged window
+struct window_awaitable {
+	waiter w;
+
+	bool await_ready() { return w.ready(); }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		w.handle = h;
+		return w.exec->wait(&w);
+	}
+	// false only for reader at end of stream
+	bool await_resume() { return w.window->len >= w.min_bytes; }
+};
+
+class reader {
+public:
+	reader(executor &e, struct shm_fifo *fifo) : exec(e)
+	{
+		fifo_window_init_reader(fifo, &w, 0, fifo->size);
+	}
+
+	struct fifo_window &window() { return w; }
+
+	// resumes once window has min_bytes of data or writer closed
+	// fifo. Result is false when stream ended with less than
+	// min_bytes left (window still holds them)
+	window_awaitable readable(unsigned min_bytes = 1)
+	{
+		return window_awaitable{waiter{&exec, {}, &w, min_bytes}};
+	}
+
+private:
+	executor &exec;
+	struct fifo_window w;
+};
+
+class writer {
+public:
+	writer(executor &e, struct shm_fifo *fifo) : exec(e)
+	{
+		fifo_window_init_writer(fifo, &w, 0, fifo->size);
+	}
+
+	struct fifo_window &window() { return w; }
+
+	// resumes once window has min_bytes (at most fifo size) of room,
+	// publishing what was produced so far
+	window_awaitable writable(unsigned min_bytes = 1)
+	{
+		return window_awaitable{waiter{&exec, {}, &w, min_bytes}};
+	}
+
+	void close() { fifo_window_close_writer(&w); }
+
+private:
+	executor &exec;
+	struct fifo_window w;
+};
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "fifo_trace.h"
+
+__thread struct fifo_trace_ring *fifo_trace_current_ring;
+
+/* all rings ever registered. Rings outlive their threads, so trace
+ * can be dumped after threads are joined */
+static
+struct fifo_trace_ring *rings;
+
+/* clock reading at first registration, paired with CLOCK_MONOTONIC
+ * to convert ticks to time at dump */
+static
+uint64_t base_clock, base_ns;
+
+static
+uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct fifo_trace_ring *fifo_trace_register_thread(void)
+{
+	struct fifo_trace_ring *ring = calloc(1, sizeof(*ring));
+	struct fifo_trace_ring *head;
+
+	if (!ring) {
+		perror("fifo_trace_register_thread");
+		abort();
+	}
+	ring->tid = syscall(__NR_gettid);
+
+	if (__sync_bool_compare_and_swap(&base_ns, 0, clock_ns()))
+		base_clock = fifo_trace_clock();
+
+	do {
+		head = rings;
+		ring->next = head;
+	} while (!__sync_bool_compare_and_swap(&rings, head, ring));
+
+	fifo_trace_current_ring = ring;
+	return ring;
+}
+
+static
+void dump_ring(FILE *f, struct fifo_trace_ring *ring, double us_per_tick, int *first)
+{
+	uint64_t i = 0;
+	int pid = getpid();
+	double sleep_start = -1;
+
+	if (ring->count > FIFO_TRACE_RING_SIZE)
+		i = ring->count - FIFO_TRACE_RING_SIZE;
+
+	if (i < ring->count) {
+		struct fifo_trace_record *r = &ring->records[i & (FIFO_TRACE_RING_SIZE - 1)];
+		fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"name\": \"%s %d\"}}",
+			*first ? "" : ",", pid, ring->tid, r->reader ? "reader" : "writer", ring->tid);
+		*first = 0;
+	}
+
+	for (; i < ring->count; i++) {
+		struct fifo_trace_record *r = &ring->records[i & (FIFO_TRACE_RING_SIZE - 1)];
+		double ts = (double)(int64_t)(r->tsc - base_clock) * us_per_tick;
+		const char *side = r->reader ? "reader" : "writer";
+
+		switch (r->event) {
+		case FIFO_TRACE_EXCHANGE:
+			fprintf(f, ",\n{\"name\": \"%s window %p\", \"ph\": \"C\", \"ts\": %.3f, "
+				"\"pid\": %d, \"tid\": %d, \"args\": {\"len\": %u}}",
+				side, r->fifo, ts, pid, ring->tid, r->len);
+			break;
+		case FIFO_TRACE_SPIN_EXIT:
+			fprintf(f, ",\n{\"name\": \"spin exit\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+				"\"pid\": %d, \"tid\": %d, \"args\": {\"fifo\": \"%p\", \"spins\": %u}}",
+				ts, pid, ring->tid, r->fifo, r->len);
+			break;
+		case FIFO_TRACE_SLEEP:
+			sleep_start = ts;
+			break;
+		case FIFO_TRACE_WAKE_RECEIVED:
+			/* sleep record may be overwritten already */
+			if (sleep_start < 0)
+				break;
+			fprintf(f, ",\n{\"name\": \"sleep\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+				"\"pid\": %d, \"tid\": %d, \"args\": {\"fifo\": \"%p\", \"len\": %u}}",
+				sleep_start, ts - sleep_start, pid, ring->tid, r->fifo, r->len);
+			sleep_start = -1;
+			break;
+		case FIFO_TRACE_WAKE_SENT:
+			fprintf(f, ",\n{\"name\": \"wake sent\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+				"\"pid\": %d, \"tid\": %d, \"args\": {\"fifo\": \"%p\", \"len\": %u}}",
+				ts, pid, ring->tid, r->fifo, r->len);
+			break;
+		}
+	}
+}
+
+int fifo_trace_dump(const char *path)
+{
+	struct fifo_trace_ring *ring;
+	uint64_t ticks, ns;
+	double us_per_tick = 0;
+	int first = 1;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return errno;
+
+	ns = clock_ns() - base_ns;
+	ticks = fifo_trace_clock() - base_clock;
+	if (base_ns && ticks)
+		us_per_tick = (double)ns / ticks * 1E-3;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for (ring = rings; ring; ring = ring->next)
+		dump_ring(f, ring, us_per_tick, &first);
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+		return errno;
+	return 0;
+}
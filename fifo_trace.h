@@ -0,0 +1,84 @@
+#ifndef SHM_FIFO_TRACE_H
+#define SHM_FIFO_TRACE_H
+#include <stdint.h>
+#include <time.h>
+
+/* optional event trace of fifo internals. Every thread that touches
+ * fifo gets its own ring of TSC-stamped records, so tracing adds no
+ * shared cache lines. Without FIFO_TRACE hooks compile to nothing */
+
+enum fifo_trace_event {
+	FIFO_TRACE_EXCHANGE,		/* len is new window length */
+	FIFO_TRACE_SPIN_EXIT,		/* other side moved while spinning, len is spins */
+	FIFO_TRACE_SLEEP,		/* going to sleep in kernel */
+	FIFO_TRACE_WAKE_SENT,		/* woke other side */
+	FIFO_TRACE_WAKE_RECEIVED,	/* returned from sleep */
+	FIFO_TRACE_EVENTS
+};
+
+#ifdef FIFO_TRACE
+
+/* records per thread, power of two. Oldest records are overwritten */
+#ifndef FIFO_TRACE_RING_SIZE
+#define FIFO_TRACE_RING_SIZE 65536
+#endif
+
+struct fifo_trace_record {
+	uint64_t tsc;
+	const void *fifo;
+	unsigned len;
+	unsigned char event;
+	unsigned char reader;
+};
+
+struct fifo_trace_ring {
+	struct fifo_trace_ring *next;
+	int tid;
+	uint64_t count;
+	struct fifo_trace_record records[FIFO_TRACE_RING_SIZE];
+};
+
+extern __thread struct fifo_trace_ring *fifo_trace_current_ring;
+
+struct fifo_trace_ring *fifo_trace_register_thread(void);
+
+static inline
+uint64_t fifo_trace_clock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline
+void fifo_trace(enum fifo_trace_event event, const void *fifo, int reader, unsigned len)
+{
+	struct fifo_trace_ring *ring = fifo_trace_current_ring;
+	struct fifo_trace_record *record;
+
+	if (__builtin_expect(!ring, 0))
+		ring = fifo_trace_register_thread();
+	record = &ring->records[ring->count++ & (FIFO_TRACE_RING_SIZE - 1)];
+	record->tsc = fifo_trace_clock();
+	record->fifo = fifo;
+	record->len = len;
+	record->event = event;
+	record->reader = reader;
+}
+
+/* writes records of all threads as Chrome trace event JSON (loads in
+ * chrome://tracing and ui.perfetto.dev). Sleeps become duration
+ * events, window lengths become counter tracks. Returns 0 or errno */
+int fifo_trace_dump(const char *path);
+
+#else
+
+#define fifo_trace(event, fifo, reader, len) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic_ops.h>
+#include <linux/io_uring.h>
+
+#include "fifo_uring.h"
+
+#define SLOT_PENDING 0
+#define SLOT_COMPLETE 1
+#define SLOT_EOF 2
+#define SLOT_ERROR 3
+
+static
+int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static
+int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int fifo_uring_init(struct fifo_uring *ring, struct shm_fifo *fifo, unsigned depth)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	char *sq, *cq;
+	int fd, rv;
+
+	memset(ring, 0, sizeof(*ring));
+	if (depth == 0 || depth > FIFO_URING_MAX_DEPTH)
+		return -EINVAL;
+
+	memset(&p, 0, sizeof(p));
+	fd = io_uring_setup(depth, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->fifo = fifo;
+	ring->ring_fd = fd;
+	ring->depth = depth;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	sq = mmap(0, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto out_errno;
+	ring->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(0, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto out_errno;
+	}
+	ring->cq_ring = cq;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = 0;
+		goto out_errno;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* whole data area is single fixed buffer, so any span of it
+	 * can be used with READ_FIXED/WRITE_FIXED */
+	iov.iov_base = fifo->data;
+	iov.iov_len = fifo->size;
+	rv = io_uring_register(fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	ring->fixed = (rv == 0);
+	if (!ring->fixed)
+		fprintf(stderr, "fifo_uring_init: fixed buffers unavailable (%s), using plain ops\n", strerror(errno));
+
+	return 0;
+
+out_errno:
+	rv = -errno;
+	fifo_uring_release(ring);
+	return rv;
+}
+
+void fifo_uring_release(struct fifo_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->ring_fd > 0)
+		close(ring->ring_fd);
+	memset(ring, 0, sizeof(*ring));
+}
+
+static
+void uring_queue_slot(struct fifo_uring *ring, unsigned slot_nr, int fd, int write)
+{
+	struct fifo_uring_slot *slot = &ring->slots[slot_nr];
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	unsigned start = (slot->pos + slot->done) & (ring->fifo->size - 1);
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)(ring->fifo->data + start);
+	sqe->len = slot->len - slot->done;
+	sqe->off = (slot->offset < 0) ? (uint64_t)-1 : (uint64_t)(slot->offset + slot->done);
+	sqe->user_data = slot_nr;
+
+	ring->sq_array[index] = index;
+	AO_nop_full();
+	*ring->sq_tail = tail + 1;
+	ring->to_submit++;
+	ring->submit_count++;
+}
+
+static
+int uring_enter(struct fifo_uring *ring, unsigned min_complete)
+{
+	int rv;
+	do {
+		ring->enter_count++;
+		rv = io_uring_enter(ring->ring_fd, ring->to_submit, min_complete,
+				    min_complete ? IORING_ENTER_GETEVENTS : 0);
+	} while (rv < 0 && errno == EINTR);
+	if (rv < 0)
+		return -errno;
+	ring->to_submit -= rv;
+	return 0;
+}
+
+/* handles all posted completions. Partially transferred slots are
+ * queued again for their remainder */
+static
+void uring_reap(struct fifo_uring *ring, int fd, int write)
+{
+	unsigned head = *ring->cq_head;
+
+	while (1) {
+		struct io_uring_cqe *cqe;
+		struct fifo_uring_slot *slot;
+
+		AO_nop_full();
+		if (head == *ring->cq_tail)
+			break;
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		slot = &ring->slots[cqe->user_data];
+		head++;
+
+		if (cqe->res < 0) {
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+				ring->resubmit_count++;
+				uring_queue_slot(ring, cqe->user_data, fd, write);
+				continue;
+			}
+			slot->state = SLOT_ERROR;
+			slot->err = cqe->res;
+			continue;
+		}
+		if (cqe->res == 0) {
+			slot->state = SLOT_EOF;
+			continue;
+		}
+		slot->done += cqe->res;
+		if (slot->done < slot->len) {
+			ring->resubmit_count++;
+			uring_queue_slot(ring, cqe->user_data, fd, write);
+			continue;
+		}
+		slot->state = SLOT_COMPLETE;
+	}
+
+	AO_nop_full();
+	*ring->cq_head = head;
+}
+
+/* eats contiguous completed prefix of in-flight slots from
+ * window. Returns number of bytes eaten, sets *stop on EOF or failed
+ * request. Slots completing after stop are discarded, since their
+ * data is not contiguous with published data anymore */
+static
+unsigned uring_retire_slots(struct fifo_uring *ring, struct fifo_window *window,
+			    int *stop, int *err)
+{
+	unsigned eaten = 0;
+
+	while (ring->slot_count) {
+		struct fifo_uring_slot *slot = &ring->slots[ring->slot_head];
+		if (slot->state == SLOT_PENDING)
+			break;
+		if (!*stop) {
+			eaten += slot->done;
+			if (slot->state == SLOT_ERROR)
+				*err = slot->err;
+			if (slot->state != SLOT_COMPLETE)
+				*stop = 1;
+		}
+		ring->slot_head = (ring->slot_head + 1) % ring->depth;
+		ring->slot_count--;
+	}
+
+	fifo_window_eat_span(window, eaten);
+	return eaten;
+}
+
+static
+int uring_fill(struct fifo_uring *ring, struct fifo_window *window, unsigned *queued,
+	       int fd, off_t *offset, unsigned chunk, int write)
+{
+	unsigned max = (*offset < 0) ? 1 : ring->depth;
+	int count = 0;
+
+	while (ring->slot_count < max && *queued < window->len) {
+		unsigned slot_nr = (ring->slot_head + ring->slot_count) % ring->depth;
+		struct fifo_uring_slot *slot = &ring->slots[slot_nr];
+		unsigned pos = window->start + *queued;
+		unsigned len = window->len - *queued;
+		unsigned linear = window->size - (pos & (window->size - 1));
+
+		if (len > linear)
+			len = linear;
+		if (len > chunk)
+			len = chunk;
+
+		slot->pos = pos;
+		slot->len = len;
+		slot->done = 0;
+		slot->state = SLOT_PENDING;
+		slot->offset = *offset;
+		if (*offset >= 0)
+			*offset += len;
+
+		ring->slot_count++;
+		*queued += len;
+		uring_queue_slot(ring, slot_nr, fd, write);
+		count++;
+	}
+	return count;
+}
+
+int64_t fifo_uring_ingest(struct fifo_uring *ring, struct fifo_window *window,
+			  int fd, off_t offset, unsigned chunk)
+{
+	int64_t total = 0;
+	unsigned queued = 0;
+	int stop = 0, err = 0;
+
+	fifo_window_exchange_writer(window);
+
+	while (1) {
+		unsigned eaten;
+		int rv;
+
+		if (!stop)
+			uring_fill(ring, window, &queued, fd, &offset, chunk, 0);
+
+		if (ring->slot_count == 0) {
+			if (stop)
+				break;
+			/* fifo is full */
+			fifo_window_writer_wait(window);
+			fifo_window_exchange_writer(window);
+			continue;
+		}
+
+		rv = uring_enter(ring, 1);
+		if (rv < 0) {
+			err = rv;
+			break;
+		}
+		uring_reap(ring, fd, 0);
+
+		eaten = uring_retire_slots(ring, window, &stop, &err);
+		if (eaten) {
+			queued -= eaten;
+			total += eaten;
+			fifo_window_exchange_writer(window);
+		}
+		if (stop && ring->slot_count == 0)
+			break;
+	}
+
+	if (err)
+		return err;
+	return total;
+}
+
+int64_t fifo_uring_egress(struct fifo_uring *ring, struct fifo_window *window,
+			  int fd, off_t offset, unsigned chunk)
+{
+	int64_t total = 0;
+	unsigned queued = 0;
+	int stop = 0, err = 0;
+
+	while (1) {
+		unsigned eaten;
+		int rv;
+
+		if (!stop)
+			uring_fill(ring, window, &queued, fd, &offset, chunk, 1);
+
+		if (ring->slot_count == 0) {
+			int finished = fifo_window_writer_closed(window);
+			if (stop)
+				break;
+			fifo_window_exchange_reader(window);
+			if (window->len)
+				continue;
+			if (finished)
+				break;
+			fifo_window_reader_wait(window);
+			continue;
+		}
+
+		rv = uring_enter(ring, 1);
+		if (rv < 0) {
+			err = rv;
+			break;
+		}
+		uring_reap(ring, fd, 1);
+
+		eaten = uring_retire_slots(ring, window, &stop, &err);
+		if (eaten) {
+			queued -= eaten;
+			total += eaten;
+			fifo_window_exchange_reader(window);
+		}
+		if (stop && ring->slot_count == 0)
+			break;
+	}
+
+	if (err)
+		return err;
+	return total;
+}
@@ -0,0 +1,69 @@
+#ifndef SHM_FIFO_URING_H
+#define SHM_FIFO_URING_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fifo.h"
+
+#define FIFO_URING_MAX_DEPTH 64
+
+struct fifo_uring_slot {
+	unsigned pos;		/* fifo position of first byte */
+	unsigned len;		/* bytes requested */
+	unsigned done;		/* bytes transferred so far */
+	int state;
+	int err;		/* -errno of failed request */
+	off_t offset;		/* file offset of first byte */
+};
+
+/* io_uring instance bound to single fifo. Rings are mapped directly
+ * (no liburing). Data area of fifo is registered as fixed buffer if
+ * kernel and RLIMIT_MEMLOCK permit, otherwise plain READ/WRITE ops
+ * are used. */
+struct fifo_uring {
+	struct shm_fifo *fifo;
+	int ring_fd;
+	int fixed;
+	unsigned depth;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* in-flight requests in submission order */
+	struct fifo_uring_slot slots[FIFO_URING_MAX_DEPTH];
+	unsigned slot_head, slot_count;
+	unsigned to_submit;
+
+	int64_t submit_count;
+	int64_t enter_count;
+	int64_t resubmit_count;
+};
+
+/* creates ring with up to depth (<= FIFO_URING_MAX_DEPTH) requests
+ * in flight. Returns 0 or -errno */
+int fifo_uring_init(struct fifo_uring *ring, struct shm_fifo *fifo, unsigned depth);
+void fifo_uring_release(struct fifo_uring *ring);
+
+/* reads fd from offset until EOF into successive spans of writer
+ * window, keeping up to ring depth reads of chunk bytes in flight.
+ * Completed data is published in order via
+ * fifo_window_exchange_writer. Window is expected to be inited with
+ * min_length 0 and pull_length equal to fifo size. Pass offset -1 for
+ * non-seekable fds, in which case only one read is in flight at a
+ * time. Returns number of bytes ingested or -errno */
+int64_t fifo_uring_ingest(struct fifo_uring *ring, struct fifo_window *window,
+			  int fd, off_t offset, unsigned chunk);
+
+/* symmetric to above: writes spans of reader window to fd until
+ * writer closes fifo and it is drained. Written data is released in
+ * order via fifo_window_exchange_reader. Returns number of bytes
+ * written or -errno */
+int64_t fifo_uring_egress(struct fifo_uring *ring, struct fifo_window *window,
+			  int fd, off_t offset, unsigned chunk);
+
+#endif
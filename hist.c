@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hist.h"
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned i;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->total += src->total;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static
+uint64_t bucket_high_value(unsigned index)
+{
+	unsigned shift;
+	uint64_t mantissa;
+	if (index < 2 * HIST_SUB_COUNT)
+		return index;
+	shift = index / HIST_SUB_COUNT - 1;
+	mantissa = index % HIST_SUB_COUNT + HIST_SUB_COUNT;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double percentile)
+{
+	uint64_t target, seen = 0;
+	unsigned i;
+
+	if (!h->count)
+		return 0;
+	target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > h->count)
+		target = h->count;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t value = bucket_high_value(i);
+			return value > h->max ? h->max : value;
+		}
+	}
+	return h->max;
+}
+
+void hist_print(FILE *f, const char *label, const struct hist *h)
+{
+	if (!h->count) {
+		fprintf(f, "%s: no samples\n", label);
+		return;
+	}
+	fprintf(f, "%s: n=%llu min=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu p99.99=%llu max=%llu\n",
+		label,
+		(unsigned long long)h->count,
+		(unsigned long long)h->min,
+		(double)h->total / h->count,
+		(unsigned long long)hist_percentile(h, 50),
+		(unsigned long long)hist_percentile(h, 90),
+		(unsigned long long)hist_percentile(h, 99),
+		(unsigned long long)hist_percentile(h, 99.9),
+		(unsigned long long)hist_percentile(h, 99.99),
+		(unsigned long long)h->max);
+}
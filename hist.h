@@ -0,0 +1,54 @@
+#ifndef SHM_HIST_H
+#define SHM_HIST_H
+#include <stdint.h>
+#include <stdio.h>
+
+/* HDR-style histogram: values are bucketed by power of two, each
+ * power of two split into HIST_SUB_COUNT linear sub-buckets. That
+ * gives relative error below 1/HIST_SUB_COUNT over full 64-bit
+ * range with fixed memory and O(1) recording */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min, max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline
+unsigned hist_bucket(uint64_t value)
+{
+	unsigned shift;
+	if (value < 2 * HIST_SUB_COUNT)
+		return value;
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return shift * HIST_SUB_COUNT + (unsigned)(value >> shift);
+}
+
+static inline
+void hist_record(struct hist *h, uint64_t value)
+{
+	h->buckets[hist_bucket(value)]++;
+	h->count++;
+	h->total += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void hist_reset(struct hist *h);
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/* returns value at given percentile (0..100). Result is highest
+ * value of bucket containing it, clamped to recorded maximum */
+uint64_t hist_percentile(const struct hist *h, double percentile);
+
+/* prints count, min, mean, p50, p90, p99, p99.9, p99.99 and max on
+ * single line, prefixed by label */
+void hist_print(FILE *f, const char *label, const struct hist *h);
+
+#endif
@@ -8,25 +8,112 @@
 #include <semaphore.h>
 #include <sched.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/syscall.h>
 
 #include "fifo.h"
+#include "perf.h"
+#include "workload.h"
+#include "fifo_trace.h"
 
 #ifdef JUST_MEMCPY
-#define nrand48(dummy) 0
+#define DEFAULT_WORKLOAD "none"
+#else
+#define DEFAULT_WORKLOAD "nrand48"
 #endif
 
 #define READER_BATCH 1024
 #define WRITER_BATCH 1024
 #define SEND_WORDS 2000000000U
+#define SYNC_BYTES (1 << 20)
+
+#define MAX_VALUES 16
+
+/* parameters of single run. Batches are in ints, zero min/pull
+ * lengths mean "derive from batch" as original hard-coded values
+ * did */
+struct run_params {
+	unsigned reader_batch;
+	unsigned writer_batch;
+	unsigned spin_count;
+	unsigned fifo_size;
+	unsigned reader_min, reader_pull;
+	unsigned writer_min, writer_pull;
+};
+
+struct run_result {
+	double seconds;
+	uint64_t bytes;
+	uint64_t acc, errors;
+	uint64_t dropped;
+	struct fifo_window_stats reader, writer;
+	struct perf_counters reader_perf, writer_perf;
+};
+
+/* comma separated list of values for one parameter */
+struct param_list {
+	const char *name;
+	unsigned count;
+	unsigned values[MAX_VALUES];
+};
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+static
+struct param_list reader_batches = {"reader_batch", 1, {READER_BATCH}};
+static
+struct param_list writer_batches = {"writer_batch", 1, {WRITER_BATCH}};
+static
+struct param_list spin_counts = {"spin_count", 1, {0}};
+static
+struct param_list fifo_sizes = {"fifo_size", 1, {FIFO_SIZE}};
+static
+struct param_list reader_mins = {"reader_min", 1, {0}};
+static
+struct param_list reader_pulls = {"reader_pull", 1, {0}};
+static
+struct param_list writer_mins = {"writer_min", 1, {0}};
+static
+struct param_list writer_pulls = {"writer_pull", 1, {0}};
+
+static
+unsigned repeats = 1;
+static
+unsigned send_words = SEND_WORDS;
+static
+enum output_format format = FORMAT_TEXT;
+static
+const struct workload *workload;
+#ifdef FIFO_TRACE
+static
+char *trace_path;
+#endif
 
 static
 struct shm_fifo *fifo;
+static
+struct run_params params;
+static
+struct run_result result;
 
 static
 int setaffinity;
 static
 int serialize;
+static
+int use_perf;
+static
+int lossy;
+static
+char *persist_path;
+static
+unsigned sync_bytes = SYNC_BYTES;
 
 #define SERIALIZE 0
 
@@ -35,8 +122,6 @@ sem_t reader_sem;
 static
 sem_t writer_sem;
 
-int done_flag;
-
 static
 void fatal_perror(char *arg)
 {
@@ -64,54 +149,97 @@ void move_to_cpu(int number)
 		fatal_perror("sched_setaffinity");
 }
 
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
 
 static
 void *reader_thread(void *dummy)
 {
 	struct fifo_window window;
 	unsigned long long count=0;
-	int sum=0;
-	unsigned short xsubi[3];
-	memset(xsubi, 0, sizeof(xsubi));
-
-	printf("reader's pid is %d\n", gettid());
+	unsigned long long pos = 0;
+	unsigned last_start;
+	unsigned batch = params.reader_batch*sizeof(int);
+	unsigned unit = workload->unit;
+	struct workload_state state;
+	memset(&state, 0, sizeof(state));
+
+	if (batch < unit)
+		batch = unit;
+
+	if (format == FORMAT_TEXT)
+		printf("reader's pid is %d\n", gettid());
 	if (setaffinity)
 		move_to_cpu(0);
 
 	if (serialize)
 		sem_wait(&reader_sem);
 
-	fifo_window_init_reader(fifo, &window, 0, READER_BATCH*sizeof(int)*2);
+	if (use_perf)
+		perf_counters_open(&result.reader_perf);
+
+	fifo_window_init_reader(fifo, &window, params.reader_min, params.reader_pull);
+	last_start = window.start;
 	while (1) {
-		int *ptr;
-		unsigned len, i;
+		void *ptr;
+		unsigned len;
+		int closed;
 
 		if (serialize) {
 			sem_post(&writer_sem);
 			sem_wait(&reader_sem);
 		}
 
+		closed = fifo_window_writer_closed(&window);
 		fifo_window_exchange_reader(&window);
 
 		if (window.len == 0) {
-			if (done_flag)
+			if (closed)
 				break;
 			fifo_window_reader_wait(&window);
 			continue;
 		}
 
+		/* writer publishes whole units and fifo size is multiple
+		 * of unit, so spans are too */
 		ptr = fifo_window_peek_span(&window, &len);
-		len /= sizeof(int);
-		if (len > READER_BATCH)
-			len = READER_BATCH;
-		fifo_window_eat_span(&window, len*sizeof(int));
-
-		for (i = 0; i < len; i++)
-			sum |= *ptr++ ^ nrand48(xsubi);
-		count += i;
+		if (len > batch)
+			len = batch - batch % unit;
+		/* stream position of span, which is ahead of count
+		 * when lossy fifo skipped overwritten data */
+		pos += window.start - last_start;
+		fifo_window_eat_span(&window, len);
+		last_start = window.start;
+
+		if (lossy) {
+			struct workload_state scratch = state;
+			workload->consume(&scratch, ptr, len, pos);
+			if (!fifo_window_overrun(&window)) {
+				state = scratch;
+				count += len;
+			}
+		} else {
+			workload->consume(&state, ptr, len, pos);
+			count += len;
+		}
+		pos += len;
 	}
-	printf("sum = 0x%08x\ncount = %lld\n", sum, count);
-	return (void *)(intptr_t)sum;
+	if (use_perf)
+		perf_counters_close(&result.reader_perf);
+	if (format == FORMAT_TEXT)
+		printf("acc = 0x%016llx\nerrors = %llu\ncount = %lld\n",
+		       (unsigned long long)state.acc, (unsigned long long)state.errors, count);
+	result.acc = state.acc;
+	result.errors = state.errors;
+	result.bytes = count;
+	result.dropped = window.stats.dropped_bytes;
+	result.reader = window.stats;
+	return 0;
 }
 
 
@@ -119,21 +247,35 @@ static
 void *writer_thread(void *dummy)
 {
 	struct fifo_window window;
-	unsigned count = 0;
-	unsigned short xsubi[3];
-	memset(xsubi, 0, sizeof(xsubi));
-
-	printf("writer's pid is %d\n", gettid());
+	unsigned long long count = 0;
+	unsigned long long total = (unsigned long long)send_words*sizeof(int);
+	unsigned batch = params.writer_batch*sizeof(int);
+	unsigned unit = workload->unit;
+	unsigned min_length = params.writer_min;
+	struct workload_state state;
+	memset(&state, 0, sizeof(state));
+
+	total -= total % unit;
+	if (batch < unit)
+		batch = unit;
+	if (min_length < unit)
+		min_length = unit;
+
+	if (format == FORMAT_TEXT)
+		printf("writer's pid is %d\n", gettid());
 	if (setaffinity)
 		move_to_cpu(1);
 
 	if (serialize)
 		sem_wait(&writer_sem);
 
-	fifo_window_init_writer(fifo, &window, 4, WRITER_BATCH*sizeof(int)*2);
-	while (count < SEND_WORDS) {
-		int *ptr;
-		unsigned len, i;
+	if (use_perf)
+		perf_counters_open(&result.writer_perf);
+
+	fifo_window_init_writer(fifo, &window, min_length, params.writer_pull);
+	while (count < total) {
+		void *ptr;
+		unsigned len;
 		fifo_window_exchange_writer(&window);
 
 		if (serialize) {
@@ -142,27 +284,265 @@ void *writer_thread(void *dummy)
 		}
 
 		ptr = fifo_window_peek_span(&window, &len);
-		len /= sizeof(int);
-		if (len > WRITER_BATCH)
-			len = WRITER_BATCH;
+		if (len > batch)
+			len = batch;
+		if (len > total - count)
+			len = total - count;
+		len -= len % unit;
+		fifo_window_eat_span(&window, len);
+		workload->produce(&state, ptr, len, count);
 		count += len;
-		if (count > SEND_WORDS) {
-			count -= len;
-			len = SEND_WORDS - count;
-			count += len;
-		}
-		fifo_window_eat_span(&window, len*sizeof(int));
-		for (i=0;i<len;i++)
-			*ptr++ = nrand48(xsubi);
 	}
-	fprintf(stderr, "writer count %u\n", count);
-	done_flag = 1;
-	fifo_window_exchange_writer(&window);
+	if (format == FORMAT_TEXT)
+		fprintf(stderr, "writer count %llu\n", count);
+	fifo_window_close_writer(&window);
+	if (use_perf)
+		perf_counters_close(&result.writer_perf);
+	result.writer = window.stats;
 	if (serialize)
 		sem_post(&reader_sem);
 	return 0;
 }
 
+static
+void run_once(void)
+{
+	pthread_t reader, writer;
+	double start;
+	int rv;
+
+	if (persist_path) {
+		/* every run records fresh ring */
+		unlink(persist_path);
+		rv = fifo_open_persistent(&fifo, persist_path, params.fifo_size, sync_bytes);
+	} else {
+		rv = fifo_create_flags(&fifo, params.fifo_size, lossy ? FIFO_LOSSY : 0);
+	}
+	if (rv) {
+		errno = rv;
+		fatal_perror("fifo_create");
+	}
+	memset(&result, 0, sizeof(result));
+
+	start = now();
+
+	rv = pthread_create(&reader, 0, reader_thread, 0);
+	if (rv)
+		fatal_perror("phread_create(&reader)");
+
+	rv = pthread_create(&writer, 0, writer_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&writer)");
+
+	if (serialize)
+		sem_post(&writer_sem);
+
+	pthread_join(reader, 0);
+	pthread_join(writer, 0);
+
+	result.seconds = now() - start;
+	fifo_destroy(fifo);
+}
+
+static
+void print_header(void)
+{
+	int i;
+
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("sizeof(struct shm_fifo) = %d\n", (int)sizeof(struct shm_fifo));
+		break;
+	case FORMAT_CSV:
+		printf("implementation,workload,reader_batch,writer_batch,spin_count,fifo_size,"
+		       "reader_min,reader_pull,writer_min,writer_pull,repeat,"
+		       "bytes,seconds,gbps,acc,errors,dropped,"
+		       "reader_exchange_count,writer_exchange_count,"
+		       "reader_wake_count,writer_wake_count,"
+		       "reader_wait_spins,writer_wait_spins,"
+		       "reader_wait_calls,writer_wait_calls");
+		for (i = 0; i < PERF_COUNTERS; i++)
+			printf(",reader_%s,writer_%s", perf_counter_names[i], perf_counter_names[i]);
+		printf("\n");
+		break;
+	case FORMAT_JSON:
+		printf("[");
+		break;
+	}
+}
+
+static
+void print_footer(void)
+{
+	if (format == FORMAT_JSON)
+		printf("\n]\n");
+}
+
+/* unavailable (or not requested) counters are empty CSV fields and
+ * JSON nulls */
+static
+void print_perf_value(int json, const char *side, const struct perf_counters *pc, int i)
+{
+	if (json)
+		printf(", \"%s_%s\": ", side, perf_counter_names[i]);
+	else
+		printf(",");
+	if (perf_counter_valid(pc, i))
+		printf("%llu", (unsigned long long)pc->value[i]);
+	else if (json)
+		printf("null");
+}
+
+static
+void print_perf_fields(int json)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		print_perf_value(json, "reader", &result.reader_perf, i);
+		print_perf_value(json, "writer", &result.writer_perf, i);
+	}
+}
+
+/* wake counts are named after woken side, as global counters are:
+ * reader is woken by writer window and vice versa */
+static
+void print_result(unsigned repeat, int first)
+{
+	double gbps = result.bytes / result.seconds * 1E-9;
+
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("FIFO_SIZE = %u, reader_batch = %u, writer_batch = %u, spin_count = %u\n",
+		       params.fifo_size, params.reader_batch, params.writer_batch, params.spin_count);
+		printf("reader min/pull = %u/%u, writer min/pull = %u/%u, repeat %u\n",
+		       params.reader_min, params.reader_pull,
+		       params.writer_min, params.writer_pull, repeat);
+		printf("workload = %s\n", workload->name);
+		printf("%.3f sec, %.3f GB/s\n", result.seconds, gbps);
+		if (lossy)
+			printf("dropped = %llu\n", (unsigned long long)result.dropped);
+		printf("fifo_writer_exchange_count = %lld\n", (long long)result.writer.exchange_count);
+		printf("fifo_writer_wake_count = %lld\n", (long long)result.reader.wake_count);
+		printf("fifo_reader_exchange_count = %lld\n", (long long)result.reader.exchange_count);
+		printf("fifo_reader_wake_count = %lld\n", (long long)result.writer.wake_count);
+		printf("fifo_reader_wait_spins = %lld\n", (long long)result.reader.wait_spins);
+		printf("fifo_writer_wait_spins = %lld\n", (long long)result.writer.wait_spins);
+		printf("fifo_reader_wait_calls = %lld\n", (long long)result.reader.wait_calls);
+		printf("fifo_writer_wait_calls = %lld\n", (long long)result.writer.wait_calls);
+		if (use_perf) {
+			perf_counters_print(stdout, "reader perf", &result.reader_perf,
+					    result.bytes, result.reader.exchange_count);
+			perf_counters_print(stdout, "writer perf", &result.writer_perf,
+					    result.bytes, result.writer.exchange_count);
+		}
+		break;
+	case FORMAT_CSV:
+		printf("\"%s\",\"%s\",%u,%u,%u,%u,%u,%u,%u,%u,%u,%llu,%.6f,%.4f,%llu,%llu,%llu,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld",
+		       fifo_implementation_type, workload->name,
+		       params.reader_batch, params.writer_batch, params.spin_count, params.fifo_size,
+		       params.reader_min, params.reader_pull, params.writer_min, params.writer_pull,
+		       repeat, (unsigned long long)result.bytes, result.seconds, gbps,
+		       (unsigned long long)result.acc, (unsigned long long)result.errors,
+		       (unsigned long long)result.dropped,
+		       (long long)result.reader.exchange_count, (long long)result.writer.exchange_count,
+		       (long long)result.writer.wake_count, (long long)result.reader.wake_count,
+		       (long long)result.reader.wait_spins, (long long)result.writer.wait_spins,
+		       (long long)result.reader.wait_calls, (long long)result.writer.wait_calls);
+		print_perf_fields(0);
+		printf("\n");
+		break;
+	case FORMAT_JSON:
+		printf("%s\n {\"implementation\": \"%s\", \"workload\": \"%s\", \"reader_batch\": %u, \"writer_batch\": %u, "
+		       "\"spin_count\": %u, \"fifo_size\": %u, "
+		       "\"reader_min\": %u, \"reader_pull\": %u, \"writer_min\": %u, \"writer_pull\": %u, "
+		       "\"repeat\": %u, \"bytes\": %llu, \"seconds\": %.6f, \"gbps\": %.4f, "
+		       "\"acc\": %llu, \"errors\": %llu, \"dropped\": %llu, "
+		       "\"reader_exchange_count\": %lld, \"writer_exchange_count\": %lld, "
+		       "\"reader_wake_count\": %lld, \"writer_wake_count\": %lld, "
+		       "\"reader_wait_spins\": %lld, \"writer_wait_spins\": %lld, "
+		       "\"reader_wait_calls\": %lld, \"writer_wait_calls\": %lld",
+		       first ? "" : ",", fifo_implementation_type, workload->name,
+		       params.reader_batch, params.writer_batch, params.spin_count, params.fifo_size,
+		       params.reader_min, params.reader_pull, params.writer_min, params.writer_pull,
+		       repeat, (unsigned long long)result.bytes, result.seconds, gbps,
+		       (unsigned long long)result.acc, (unsigned long long)result.errors,
+		       (unsigned long long)result.dropped,
+		       (long long)result.reader.exchange_count, (long long)result.writer.exchange_count,
+		       (long long)result.writer.wake_count, (long long)result.reader.wake_count,
+		       (long long)result.reader.wait_spins, (long long)result.writer.wait_spins,
+		       (long long)result.reader.wait_calls, (long long)result.writer.wait_calls);
+		print_perf_fields(1);
+		printf("}");
+		break;
+	}
+	fflush(stdout);
+}
+
+/* runs every combination of parameter lists, repeats times each */
+static
+void sweep(void)
+{
+	unsigned rb, wb, sc, fs, rm, rp, wm, wp, repeat;
+	int first = 1;
+
+	for (fs = 0; fs < fifo_sizes.count; fs++)
+	for (sc = 0; sc < spin_counts.count; sc++)
+	for (rb = 0; rb < reader_batches.count; rb++)
+	for (wb = 0; wb < writer_batches.count; wb++)
+	for (rm = 0; rm < reader_mins.count; rm++)
+	for (rp = 0; rp < reader_pulls.count; rp++)
+	for (wm = 0; wm < writer_mins.count; wm++)
+	for (wp = 0; wp < writer_pulls.count; wp++) {
+		params.fifo_size = fifo_sizes.values[fs];
+		params.spin_count = spin_counts.values[sc];
+		params.reader_batch = reader_batches.values[rb];
+		params.writer_batch = writer_batches.values[wb];
+		params.reader_min = reader_mins.values[rm];
+		params.reader_pull = reader_pulls.values[rp];
+		params.writer_min = writer_mins.values[wm];
+		params.writer_pull = writer_pulls.values[wp];
+
+		/* defaults of original benchmark */
+		if (!params.spin_count)
+			params.spin_count = fifo_spin_count;
+		if (!params.reader_pull)
+			params.reader_pull = params.reader_batch*sizeof(int)*2;
+		if (!params.writer_min)
+			params.writer_min = sizeof(int);
+		if (!params.writer_pull)
+			params.writer_pull = params.writer_batch*sizeof(int)*2;
+
+		for (repeat = 0; repeat < repeats; repeat++) {
+			unsigned saved_spin_count = fifo_spin_count;
+			fifo_spin_count = params.spin_count;
+			run_once();
+			fifo_spin_count = saved_spin_count;
+			print_result(repeat, first);
+			first = 0;
+		}
+	}
+}
+
+static
+void parse_list(struct param_list *list, char *arg)
+{
+	char *p;
+
+	list->count = 0;
+	for (p = strtok(arg, ","); p; p = strtok(0, ",")) {
+		if (list->count == MAX_VALUES) {
+			fprintf(stderr, "too many values for %s\n", list->name);
+			exit(1);
+		}
+		list->values[list->count++] = strtoul(p, 0, 0);
+	}
+	if (!list->count) {
+		fprintf(stderr, "empty list for %s\n", list->name);
+		exit(1);
+	}
+}
+
 static
 char *usage_text =
 	"Usage: %s [options]\n"
@@ -170,21 +550,66 @@ char *usage_text =
 	"This binary has %s fifo implementation.\n"
 	"  -a\tset affinity for dual- core or CPU machine\n"
 	"  -s\tserialize processing for debugging\n"
+	"  -n count\trepeat every configuration count times (default 1)\n"
+	"  -N words\tints sent per run (default %u). Reported counts\n"
+	"    \t(writer count, count, bytes) are in bytes, 4 per int\n"
+	"  -f format\toutput format: text (default), csv or json\n"
+	"  -P\tcollect per-thread perf_event counters (raw event code of\n"
+	"    \tcache line transfers can be given in FIFO_PERF_TRANSFER_EVENT)\n"
+	"  -w workload\tdata processing run in place on every span (default %s)\n"
+	"  -L\tlossy fifo: writer never waits and overwrites unread data\n"
+	"    \t(use position based workload, e.g. prng)\n"
+	"  -p file\tfile backed persistent fifo (recreated every run)\n"
+	"  -y bytes\tmsync persistent fifo every that many bytes (default %d)\n"
+	"  -T file\twrite Chrome trace JSON of fifo events (binaries built\n"
+	"    \twith FIFO_TRACE only, see 'make trace')\n"
+	"Parameters below take comma separated lists of values, every\n"
+	"combination is run:\n"
+	"  -R, --reader-batch\tmax ints processed per reader span (default %d)\n"
+	"  -W, --writer-batch\tmax ints produced per writer span (default %d)\n"
+	"  -S, --spin-count\tspins before sleeping in wait (default %u)\n"
+	"  -F, --fifo-size\tfifo data size, power of two (default %d)\n"
+	"      --reader-min\tmin_length of reader window (default 0)\n"
+	"      --reader-pull\tpull_length of reader window (default 2 reader batches)\n"
+	"      --writer-min\tmin_length of writer window (default 4)\n"
+	"      --writer-pull\tpull_length of writer window (default 2 writer batches)\n"
 	"\n";
 
 static
 void usage(char **argv)
 {
-	fprintf(stderr, usage_text, argv[0], fifo_implementation_type);
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		SEND_WORDS, DEFAULT_WORKLOAD, SYNC_BYTES, READER_BATCH, WRITER_BATCH, fifo_spin_count, FIFO_SIZE);
+	fprintf(stderr, "Workloads:\n");
+	workload_list(stderr);
 }
 
+enum {
+	OPT_READER_MIN = 256,
+	OPT_READER_PULL,
+	OPT_WRITER_MIN,
+	OPT_WRITER_PULL,
+};
+
+static
+struct option long_options[] = {
+	{"reader-batch", required_argument, 0, 'R'},
+	{"writer-batch", required_argument, 0, 'W'},
+	{"spin-count", required_argument, 0, 'S'},
+	{"fifo-size", required_argument, 0, 'F'},
+	{"reader-min", required_argument, 0, OPT_READER_MIN},
+	{"reader-pull", required_argument, 0, OPT_READER_PULL},
+	{"writer-min", required_argument, 0, OPT_WRITER_MIN},
+	{"writer-pull", required_argument, 0, OPT_WRITER_PULL},
+	{0, 0, 0, 0}
+};
+
 int main(int argc, char **argv)
 {
 	int rv;
-	pthread_t reader, writer;
 	int optchar;
 
-	while ((optchar = getopt(argc, argv, "as")) >= 0) {
+	while ((optchar = getopt_long(argc, argv, "asPLn:N:f:w:p:y:T:R:W:S:F:", long_options, 0)) >= 0) {
 		switch (optchar) {
 		case 'a':
 			setaffinity = 1;
@@ -192,14 +617,88 @@ int main(int argc, char **argv)
 		case 's':
 			serialize = 1;
 			break;
+		case 'P':
+			use_perf = 1;
+			break;
+		case 'L':
+			lossy = 1;
+			break;
+		case 'p':
+			persist_path = optarg;
+			break;
+		case 'y':
+			sync_bytes = strtoul(optarg, 0, 0);
+			break;
+		case 'n':
+			repeats = strtoul(optarg, 0, 0);
+			break;
+		case 'N':
+			send_words = strtoul(optarg, 0, 0);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = FORMAT_JSON;
+			else {
+				usage(argv);
+				exit(1);
+			}
+			break;
+		case 'w':
+			workload = workload_find(optarg);
+			if (!workload) {
+				fprintf(stderr, "unknown workload %s, available workloads:\n", optarg);
+				workload_list(stderr);
+				exit(1);
+			}
+			break;
+		case 'T':
+#ifdef FIFO_TRACE
+			trace_path = optarg;
+#else
+			fprintf(stderr, "-T needs binary built with FIFO_TRACE\n");
+			exit(1);
+#endif
+			break;
+		case 'R':
+			parse_list(&reader_batches, optarg);
+			break;
+		case 'W':
+			parse_list(&writer_batches, optarg);
+			break;
+		case 'S':
+			parse_list(&spin_counts, optarg);
+			break;
+		case 'F':
+			parse_list(&fifo_sizes, optarg);
+			break;
+		case OPT_READER_MIN:
+			parse_list(&reader_mins, optarg);
+			break;
+		case OPT_READER_PULL:
+			parse_list(&reader_pulls, optarg);
+			break;
+		case OPT_WRITER_MIN:
+			parse_list(&writer_mins, optarg);
+			break;
+		case OPT_WRITER_PULL:
+			parse_list(&writer_pulls, optarg);
+			break;
 		default:
 			usage(argv);
 			exit(1);
 		}
 	}
 
-	printf("FIFO_SIZE = %d\n", FIFO_SIZE);
-	printf("sizeof(struct shm_fifo) = %d\n", sizeof(struct shm_fifo));
+	if (!workload)
+		workload = workload_find(DEFAULT_WORKLOAD);
+	if (lossy && persist_path) {
+		fprintf(stderr, "-L and -p can't be combined\n");
+		exit(1);
+	}
 
 	if (serialize) {
 		rv = sem_init(&reader_sem, 0, 0);
@@ -210,32 +709,19 @@ int main(int argc, char **argv)
 			fatal_perror("sem_init(&writer_sem,...)");
 	}
 
-	rv = fifo_create(&fifo);
-	if (rv)
-		fatal_perror("fifo_create");
-
-	rv = pthread_create(&reader, 0, reader_thread, 0);
-	if (rv)
-		fatal_perror("phread_create(&reader)");
-
-	rv = pthread_create(&writer, 0, writer_thread, 0);
-	if (rv)
-		fatal_perror("pthread_create(&writer)");
-
-	if (serialize)
-		sem_post(&writer_sem);
+	print_header();
+	sweep();
+	print_footer();
 
-	pthread_join(reader, 0);
-	pthread_join(writer, 0);
-
-	printf("fifo_writer_exchange_count = %d\n", fifo_writer_exchange_count);
-	printf("fifo_writer_wake_count = %d\n", fifo_writer_wake_count);
-	printf("fifo_reader_exchange_count = %d\n", fifo_reader_exchange_count);
-	printf("fifo_reader_wake_count = %d\n", fifo_reader_wake_count);
-	printf("fifo_reader_wait_spins = %d\n", fifo_reader_wait_spins);
-	printf("fifo_writer_wait_spins = %d\n", fifo_writer_wait_spins);
-	printf("fifo_reader_wait_calls = %d\n", fifo_reader_wait_calls);
-	printf("fifo_writer_wait_calls = %d\n", fifo_writer_wait_calls);
+#ifdef FIFO_TRACE
+	if (trace_path) {
+		rv = fifo_trace_dump(trace_path);
+		if (rv) {
+			errno = rv;
+			fatal_perror(trace_path);
+		}
+	}
+#endif
 
 	return 0;
 }
@@ -0,0 +1,175 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "fifo_await.hpp"
+
+#define DEFAULT_TASKS 1000
+#define DEFAULT_BYTES (1U << 20)
+#define BATCH 16384
+
+// every pair of tasks (producer and consumer of one fifo) is
+// coroutine driven. Producers and consumers run on one executor
+// thread or, with -t 2, on two
+
+static unsigned tasks_count = DEFAULT_TASKS;
+static uint64_t bytes_per_task = DEFAULT_BYTES;
+static unsigned fifo_size = 4096;
+
+static uint64_t total_bytes, total_errors;
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static
+fifo_await::task producer(fifo_await::writer &wr)
+{
+	uint64_t count = 0;
+
+	while (count < bytes_per_task) {
+		co_await wr.writable(sizeof(uint64_t));
+
+		unsigned len;
+		uint64_t *ptr = (uint64_t *)fifo_window_peek_span(&wr.window(), &len);
+		if (len > BATCH)
+			len = BATCH;
+		if (len > bytes_per_task - count)
+			len = bytes_per_task - count;
+		len &= ~(unsigned)(sizeof(uint64_t) - 1);
+		for (unsigned i = 0; i < len / sizeof(uint64_t); i++)
+			ptr[i] = count / sizeof(uint64_t) + i;
+		fifo_window_eat_span(&wr.window(), len);
+		count += len;
+	}
+	wr.close();
+}
+
+static
+fifo_await::task consumer(fifo_await::reader &rd)
+{
+	uint64_t count = 0, errors = 0;
+
+	while (co_await rd.readable(sizeof(uint64_t))) {
+		unsigned len;
+		uint64_t *ptr = (uint64_t *)fifo_window_peek_span(&rd.window(), &len);
+		if (len > BATCH)
+			len = BATCH;
+		len &= ~(unsigned)(sizeof(uint64_t) - 1);
+		for (unsigned i = 0; i < len / sizeof(uint64_t); i++)
+			if (ptr[i] != count / sizeof(uint64_t) + i)
+				errors++;
+		fifo_window_eat_span(&rd.window(), len);
+		count += len;
+	}
+	// give consumed space back
+	fifo_window_exchange_reader(&rd.window());
+	__sync_fetch_and_add(&total_bytes, count);
+	__sync_fetch_and_add(&total_errors, errors + (count != bytes_per_task));
+}
+
+static
+const char *usage_text =
+	"Usage: %s [options]\n"
+	"Runs producer and consumer coroutines of many fifos on epoll\n"
+	"executors.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -n count\tnumber of fifos (default %d)\n"
+	"  -N bytes\tbytes sent through every fifo (default %u)\n"
+	"  -F size\tfifo size (default 4096)\n"
+	"  -t threads\t1 runs everything on one executor, 2 gives consumers own thread\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		DEFAULT_TASKS, DEFAULT_BYTES);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = 1;
+	int optchar, rv;
+
+	while ((optchar = getopt(argc, argv, "n:N:F:t:")) >= 0) {
+		switch (optchar) {
+		case 'n':
+			tasks_count = strtoul(optarg, 0, 0);
+			break;
+		case 'N':
+			bytes_per_task = strtoull(optarg, 0, 0) & ~(uint64_t)(sizeof(uint64_t) - 1);
+			break;
+		case 'F':
+			fifo_size = strtoul(optarg, 0, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+	if (tasks_count == 0 || threads < 1 || threads > 2) {
+		usage(argv);
+		exit(1);
+	}
+
+	// other side of every fifo runs on same thread (or on the only
+	// cpu), spinning can't see it move
+	if (threads == 1 || sysconf(_SC_NPROCESSORS_ONLN) == 1)
+		fifo_spin_count = 0;
+
+	fifo_await::executor producers_exec, consumers_exec;
+	fifo_await::executor &consumers_home = threads == 2 ? consumers_exec : producers_exec;
+	std::vector<struct shm_fifo *> fifos(tasks_count);
+	std::vector<fifo_await::writer> writers;
+	std::vector<fifo_await::reader> readers;
+
+	writers.reserve(tasks_count);
+	readers.reserve(tasks_count);
+	for (unsigned i = 0; i < tasks_count; i++) {
+		rv = fifo_create_sized(&fifos[i], fifo_size);
+		if (rv) {
+			errno = rv;
+			perror("fifo_create_sized");
+			exit(1);
+		}
+		writers.emplace_back(producers_exec, fifos[i]);
+		readers.emplace_back(consumers_home, fifos[i]);
+		producers_exec.spawn(producer(writers[i]));
+		consumers_home.spawn(consumer(readers[i]));
+	}
+
+	double start = now();
+	if (threads == 2) {
+		std::thread t([&] { consumers_exec.run(); });
+		producers_exec.run();
+		t.join();
+	} else {
+		producers_exec.run();
+	}
+	double elapsed = now() - start;
+
+	printf("fifos = %u, threads = %u, bytes per fifo = %llu\n", tasks_count, threads,
+	       (unsigned long long)bytes_per_task);
+	printf("%.3f GB/s over %.3f sec, wakeups = %llu, errors = %llu\n",
+	       total_bytes / elapsed * 1E-9, elapsed,
+	       producers_exec.wakeups + consumers_exec.wakeups,
+	       (unsigned long long)total_errors);
+
+	for (unsigned i = 0; i < tasks_count; i++)
+		fifo_destroy(fifos[i]);
+	return total_errors ? 1 : 0;
+}
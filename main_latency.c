@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "fifo.h"
+#include "hist.h"
+
+#define MAX_MESSAGE 32768
+#define DEFAULT_ITERATIONS 100000
+#define WARMUP_ITERATIONS 1000
+
+enum transport {
+	TRANSPORT_FIFO,
+	TRANSPORT_PIPE,
+	TRANSPORT_UNIX,
+	TRANSPORT_EVENTFD,
+};
+
+static
+char *transport_names[] = {"fifo", "pipe", "unix", "eventfd"};
+
+static
+int setaffinity;
+static
+int use_tsc;
+static
+enum transport transport = TRANSPORT_FIFO;
+static
+unsigned iterations = DEFAULT_ITERATIONS;
+
+static
+unsigned default_sizes[] = {8, 64, 512, 4096, 32768};
+static
+unsigned *sizes = default_sizes;
+static
+unsigned sizes_count = sizeof(default_sizes)/sizeof(default_sizes[0]);
+
+/* client -> server and server -> client */
+static
+struct shm_fifo *request_fifo, *response_fifo;
+static
+int request_fds[2], response_fds[2];
+
+static
+double tsc_ns_per_tick;
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+pid_t gettid(void)
+{
+	return syscall(__NR_gettid);
+}
+
+static
+void move_to_cpu(int number)
+{
+	pid_t tid = gettid();
+	cpu_set_t set;
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(number, &set);
+	rv = sched_setaffinity(tid, sizeof(set), &set);
+	if (rv < 0)
+		fatal_perror("sched_setaffinity");
+}
+
+static
+uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline
+uint64_t rdtsc(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+
+static
+void calibrate_tsc(void)
+{
+	uint64_t t0 = clock_ns(), c0 = rdtsc();
+	uint64_t t1, c1;
+	do {
+		t1 = clock_ns();
+	} while (t1 - t0 < 100000000);
+	c1 = rdtsc();
+	tsc_ns_per_tick = (double)(t1 - t0) / (c1 - c0);
+}
+#else
+static inline
+uint64_t rdtsc(void)
+{
+	return clock_ns();
+}
+
+static
+void calibrate_tsc(void)
+{
+	tsc_ns_per_tick = 1.0;
+}
+#endif
+
+static inline
+uint64_t timestamp(void)
+{
+	return use_tsc ? rdtsc() : clock_ns();
+}
+
+static inline
+uint64_t elapsed_ns(uint64_t start, uint64_t end)
+{
+	if (use_tsc)
+		return (uint64_t)((end - start) * tsc_ns_per_tick);
+	return end - start;
+}
+
+static
+void full_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t rv = write(fd, p, len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("write");
+		}
+		p += rv;
+		len -= rv;
+	}
+}
+
+/* returns 0 on EOF */
+static
+int full_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len) {
+		ssize_t rv = read(fd, p, len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("read");
+		}
+		if (rv == 0)
+			return 0;
+		p += rv;
+		len -= rv;
+	}
+	return 1;
+}
+
+/* echoes everything from request fifo to response fifo until client
+ * closes request fifo */
+static
+void fifo_echo_server(void)
+{
+	struct fifo_window in, out;
+
+	fifo_window_init_reader(request_fifo, &in, 0, FIFO_SIZE);
+	fifo_window_init_writer(response_fifo, &out, 1, FIFO_SIZE);
+
+	while (1) {
+		int closed = fifo_window_writer_closed(&in);
+
+		fifo_window_exchange_reader(&in);
+		if (in.len == 0) {
+			if (closed)
+				break;
+			fifo_window_reader_wait(&in);
+			continue;
+		}
+		while (in.len) {
+			unsigned len;
+			void *p;
+			if (out.len == 0)
+				fifo_window_exchange_writer(&out);
+			p = fifo_window_peek_span(&in, &len);
+			if (len > out.len)
+				len = out.len;
+			fifo_window_put(&out, p, len);
+			fifo_window_eat_span(&in, len);
+		}
+		fifo_window_exchange_writer(&out);
+	}
+	fifo_window_close_writer(&out);
+}
+
+static
+void fd_echo_server(void)
+{
+	static char buf[MAX_MESSAGE];
+	int in = request_fds[0], out = response_fds[1];
+
+	while (1) {
+		ssize_t rv = read(in, buf, sizeof(buf));
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("read");
+		}
+		if (rv == 0)
+			break;
+		full_write(out, buf, rv);
+	}
+	close(out);
+}
+
+static
+void eventfd_echo_server(void)
+{
+	uint64_t value;
+
+	while (1) {
+		if (read(request_fds[0], &value, sizeof(value)) != sizeof(value))
+			fatal_perror("read(eventfd)");
+		/* ~0 - 1 is shutdown token */
+		if (value > 1)
+			break;
+		value = 1;
+		full_write(response_fds[0], &value, sizeof(value));
+	}
+}
+
+static
+void *server_thread(void *dummy)
+{
+	if (setaffinity)
+		move_to_cpu(1);
+
+	switch (transport) {
+	case TRANSPORT_FIFO:
+		fifo_echo_server();
+		break;
+	case TRANSPORT_PIPE:
+	case TRANSPORT_UNIX:
+		fd_echo_server();
+		break;
+	case TRANSPORT_EVENTFD:
+		eventfd_echo_server();
+		break;
+	}
+	return 0;
+}
+
+struct fifo_client {
+	struct fifo_window out, in;
+};
+
+static
+void fifo_round_trip(struct fifo_client *c, char *msg, unsigned size)
+{
+	fifo_window_put(&c->out, msg, size);
+	fifo_window_exchange_writer(&c->out);
+
+	fifo_window_exchange_reader(&c->in);
+	fifo_window_take(&c->in, msg, size);
+}
+
+static
+void fd_round_trip(char *msg, unsigned size)
+{
+	full_write(request_fds[1], msg, size);
+	if (!full_read(response_fds[0], msg, size)) {
+		fprintf(stderr, "unexpected EOF\n");
+		exit(1);
+	}
+}
+
+static
+void eventfd_round_trip(void)
+{
+	uint64_t value = 1;
+	full_write(request_fds[1], &value, sizeof(value));
+	if (read(response_fds[1], &value, sizeof(value)) != sizeof(value))
+		fatal_perror("read(eventfd)");
+}
+
+static
+void run_size(struct fifo_client *c, unsigned size, struct hist *h)
+{
+	static char msg[MAX_MESSAGE];
+	unsigned i;
+
+	memset(msg, 0x5a, size);
+	hist_reset(h);
+
+	if (transport == TRANSPORT_FIFO) {
+		/* exchange waits until window has room for (or holds)
+		 * whole message */
+		c->out.min_length = size;
+		c->in.min_length = size;
+		fifo_window_exchange_writer(&c->out);
+	}
+
+	for (i = 0; i < iterations + WARMUP_ITERATIONS; i++) {
+		uint64_t start, end;
+
+		start = timestamp();
+		switch (transport) {
+		case TRANSPORT_FIFO:
+			fifo_round_trip(c, msg, size);
+			break;
+		case TRANSPORT_PIPE:
+		case TRANSPORT_UNIX:
+			fd_round_trip(msg, size);
+			break;
+		case TRANSPORT_EVENTFD:
+			eventfd_round_trip();
+			break;
+		}
+		end = timestamp();
+
+		if (i >= WARMUP_ITERATIONS)
+			hist_record(h, elapsed_ns(start, end));
+	}
+}
+
+static
+void *client_thread(void *dummy)
+{
+	struct fifo_client c;
+	struct hist *h = malloc(sizeof(*h));
+	unsigned i;
+
+	if (!h)
+		fatal_perror("malloc");
+	if (setaffinity)
+		move_to_cpu(0);
+
+	if (transport == TRANSPORT_FIFO) {
+		fifo_window_init_writer(request_fifo, &c.out, 0, FIFO_SIZE);
+		fifo_window_init_reader(response_fifo, &c.in, 0, FIFO_SIZE);
+	}
+
+	for (i = 0; i < sizes_count; i++) {
+		char label[64];
+		unsigned size = sizes[i];
+
+		if (transport == TRANSPORT_EVENTFD && i > 0)
+			break;
+		run_size(&c, size, h);
+		snprintf(label, sizeof(label), "%s rtt ns size=%u",
+			 transport_names[transport],
+			 transport == TRANSPORT_EVENTFD ? 0 : size);
+		hist_print(stdout, label, h);
+	}
+
+	switch (transport) {
+	case TRANSPORT_FIFO:
+		fifo_window_close_writer(&c.out);
+		break;
+	case TRANSPORT_PIPE:
+	case TRANSPORT_UNIX:
+		close(request_fds[1]);
+		break;
+	case TRANSPORT_EVENTFD: {
+		uint64_t value = ~0ULL - 1;
+		full_write(request_fds[1], &value, sizeof(value));
+		break;
+	}
+	}
+
+	free(h);
+	return 0;
+}
+
+static
+void setup_transport(void)
+{
+	int rv;
+
+	switch (transport) {
+	case TRANSPORT_FIFO:
+		rv = fifo_create(&request_fifo);
+		if (rv)
+			fatal_perror("fifo_create");
+		rv = fifo_create(&response_fifo);
+		if (rv)
+			fatal_perror("fifo_create");
+		break;
+	case TRANSPORT_PIPE:
+		if (pipe(request_fds) || pipe(response_fds))
+			fatal_perror("pipe");
+		break;
+	case TRANSPORT_UNIX:
+		/* both directions over single stream socket pair,
+		 * aliased so that [1] is client side and [0] server */
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, request_fds))
+			fatal_perror("socketpair");
+		response_fds[0] = request_fds[1];
+		response_fds[1] = request_fds[0];
+		break;
+	case TRANSPORT_EVENTFD:
+		/* request_fds[1] == request_fds[0] is server wakeup,
+		 * response_fds[0] == response_fds[1] client wakeup */
+		request_fds[0] = request_fds[1] = eventfd(0, 0);
+		response_fds[0] = response_fds[1] = eventfd(0, 0);
+		if (request_fds[0] < 0 || response_fds[0] < 0)
+			fatal_perror("eventfd");
+		break;
+	}
+}
+
+static
+void parse_sizes(char *arg)
+{
+	unsigned count = 1;
+	char *p;
+
+	for (p = arg; *p; p++)
+		if (*p == ',')
+			count++;
+	sizes = malloc(count * sizeof(unsigned));
+	if (!sizes)
+		fatal_perror("malloc");
+	sizes_count = 0;
+	for (p = strtok(arg, ","); p; p = strtok(0, ",")) {
+		unsigned size = strtoul(p, 0, 0);
+		if (size == 0 || size > MAX_MESSAGE) {
+			fprintf(stderr, "message size must be within 1..%d\n", MAX_MESSAGE);
+			exit(1);
+		}
+		sizes[sizes_count++] = size;
+	}
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Ping-pong round trip latency benchmark.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -a\tset affinity for dual- core or CPU machine\n"
+	"  -b name\tbaseline transport instead of fifo: pipe, unix or eventfd\n"
+	"  -s list\tcomma separated message sizes (default 8,64,512,4096,32768)\n"
+	"  -n count\tround trips per message size (default %u)\n"
+	"  -t\tuse rdtsc for timestamps instead of clock_gettime\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type, DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+	int rv;
+	pthread_t client, server;
+	int optchar;
+
+	while ((optchar = getopt(argc, argv, "ab:s:n:t")) >= 0) {
+		switch (optchar) {
+		case 'a':
+			setaffinity = 1;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "pipe"))
+				transport = TRANSPORT_PIPE;
+			else if (!strcmp(optarg, "unix"))
+				transport = TRANSPORT_UNIX;
+			else if (!strcmp(optarg, "eventfd"))
+				transport = TRANSPORT_EVENTFD;
+			else {
+				usage(argv);
+				exit(1);
+			}
+			break;
+		case 's':
+			parse_sizes(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, 0, 0);
+			break;
+		case 't':
+			use_tsc = 1;
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+
+	if (use_tsc)
+		calibrate_tsc();
+
+	printf("transport = %s", transport_names[transport]);
+	if (transport == TRANSPORT_FIFO)
+		printf(" (%s)", fifo_implementation_type);
+	printf(", clock = %s\n", use_tsc ? "rdtsc" : "clock_gettime");
+
+	setup_transport();
+
+	rv = pthread_create(&server, 0, server_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&server)");
+
+	rv = pthread_create(&client, 0, client_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&client)");
+
+	pthread_join(client, 0);
+	pthread_join(server, 0);
+
+	if (transport == TRANSPORT_FIFO) {
+		printf("fifo_reader_wake_count = %lld\n", (long long)fifo_reader_wake_count);
+		printf("fifo_writer_wake_count = %lld\n", (long long)fifo_writer_wake_count);
+		printf("fifo_reader_wait_calls = %lld\n", (long long)fifo_reader_wait_calls);
+		printf("fifo_reader_wait_spins = %lld\n", (long long)fifo_reader_wait_spins);
+	}
+
+	return 0;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "fifo.h"
+#include "merge.h"
+
+#define DEFAULT_SOURCES 4
+#define DEFAULT_RECORDS 1000000
+#define BATCH 64
+#define IDLE_PERIOD_US 1000
+
+/* every source thread writes records stamped by CLOCK_MONOTONIC into
+ * its own fifo, single merger thread reads them back in global time
+ * order. Idle sources write a record now and then and, unless
+ * disabled, heartbeats in between, so busy sources aren't held back
+ * by them */
+
+struct payload {
+	uint32_t source;
+	uint32_t seq;
+};
+
+static
+unsigned sources_count = DEFAULT_SOURCES;
+static
+unsigned idle_count = 1;
+static
+unsigned long records_per_source = DEFAULT_RECORDS;
+static
+unsigned payload_size = sizeof(struct payload);
+static
+int heartbeats = 1;
+static
+unsigned fifo_size = FIFO_SIZE;
+
+static
+struct shm_fifo *fifos[MERGE_MAX_SOURCES];
+static
+volatile unsigned busy_running;
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void put_data(struct fifo_window *window, unsigned source, uint32_t seq)
+{
+	char buf[payload_size];
+	struct payload *p = (struct payload *)buf;
+
+	memset(buf, 0, payload_size);
+	p->source = source;
+	p->seq = seq;
+	merge_window_put_record(window, now_ns(), MERGE_RECORD_DATA, buf, payload_size);
+}
+
+static
+void *busy_thread(void *arg)
+{
+	unsigned source = (uintptr_t)arg;
+	struct fifo_window window;
+	unsigned long i;
+
+	fifo_window_init_writer(fifos[source], &window, 0, fifos[source]->size);
+	for (i = 0; i < records_per_source; i++) {
+		put_data(&window, source, i);
+		if (i % BATCH == BATCH - 1)
+			fifo_window_exchange_writer(&window);
+	}
+	fifo_window_close_writer(&window);
+	__sync_fetch_and_sub(&busy_running, 1);
+	return 0;
+}
+
+static
+void *idle_thread(void *arg)
+{
+	unsigned source = (uintptr_t)arg;
+	struct fifo_window window;
+	uint32_t seq = 0;
+	unsigned period = 0;
+
+	fifo_window_init_writer(fifos[source], &window, 0, fifos[source]->size);
+	while (busy_running) {
+		usleep(IDLE_PERIOD_US);
+		if (period++ % 10 == 0)
+			put_data(&window, source, seq++);
+		else if (heartbeats)
+			merge_window_put_record(&window, now_ns(), MERGE_RECORD_HEARTBEAT, 0, 0);
+		fifo_window_exchange_writer(&window);
+	}
+	fifo_window_close_writer(&window);
+	return 0;
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Merges timestamped records of several source fifos into one\n"
+	"stream ordered by time and checks the order.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -k count\tnumber of sources (default %d, at most %d)\n"
+	"  -i count\thow many of them are mostly idle (default 1)\n"
+	"  -n count\trecords per busy source (default %d)\n"
+	"  -s bytes\trecord payload size (default %d)\n"
+	"  -H\tidle sources don't send heartbeats\n"
+	"  -F size\tfifo size (default %d)\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		DEFAULT_SOURCES, MERGE_MAX_SOURCES, DEFAULT_RECORDS,
+		(int)sizeof(struct payload), FIFO_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	struct fifo_window windows[MERGE_MAX_SOURCES];
+	struct fifo_window *window_ptrs[MERGE_MAX_SOURCES];
+	pthread_t threads[MERGE_MAX_SOURCES];
+	uint32_t next_seq[MERGE_MAX_SOURCES];
+	struct merge_reader *m;
+	const struct merge_record *r;
+	unsigned long long merged = 0, not_ready = 0, errors = 0;
+	uint64_t last_ts = 0, start, elapsed;
+	unsigned i;
+	int optchar, rv, source;
+
+	while ((optchar = getopt(argc, argv, "k:i:n:s:HF:")) >= 0) {
+		switch (optchar) {
+		case 'k':
+			sources_count = strtoul(optarg, 0, 0);
+			break;
+		case 'i':
+			idle_count = strtoul(optarg, 0, 0);
+			break;
+		case 'n':
+			records_per_source = strtoul(optarg, 0, 0);
+			break;
+		case 's':
+			payload_size = strtoul(optarg, 0, 0);
+			break;
+		case 'H':
+			heartbeats = 0;
+			break;
+		case 'F':
+			fifo_size = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+	if (sources_count == 0 || sources_count > MERGE_MAX_SOURCES ||
+	    idle_count >= sources_count) {
+		fprintf(stderr, "need 1..%d sources, at least one of them busy\n", MERGE_MAX_SOURCES);
+		exit(1);
+	}
+	if (payload_size < sizeof(struct payload))
+		payload_size = sizeof(struct payload);
+	if (MERGE_RECORD_SIZE(payload_size) > fifo_size / 2) {
+		fprintf(stderr, "records must fit in half of fifo\n");
+		exit(1);
+	}
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		fatal_perror("malloc");
+	for (i = 0; i < sources_count; i++) {
+		rv = fifo_create_sized(&fifos[i], fifo_size);
+		if (rv) {
+			errno = rv;
+			fatal_perror("fifo_create_sized");
+		}
+		fifo_window_init_reader(fifos[i], &windows[i], 0, fifos[i]->size);
+		window_ptrs[i] = &windows[i];
+		next_seq[i] = 0;
+	}
+	merge_reader_init(m, window_ptrs, sources_count);
+
+	busy_running = sources_count - idle_count;
+	start = now_ns();
+	for (i = 0; i < sources_count; i++) {
+		rv = pthread_create(&threads[i], 0, i < idle_count ? idle_thread : busy_thread,
+				    (void *)(uintptr_t)i);
+		if (rv) {
+			errno = rv;
+			fatal_perror("pthread_create");
+		}
+	}
+
+	while (1) {
+		const struct payload *p;
+
+		r = merge_reader_next(m, &source);
+		if (!r) {
+			if (source < 0)
+				break;
+			not_ready++;
+			merge_reader_wait(m, source);
+			continue;
+		}
+		p = (const struct payload *)r->payload;
+		if (r->timestamp < last_ts || p->source != source ||
+		    p->seq != next_seq[source])
+			errors++;
+		last_ts = r->timestamp;
+		next_seq[source] = p->seq + 1;
+		merged++;
+	}
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < sources_count; i++)
+		pthread_join(threads[i], 0);
+
+	printf("sources = %u (%u idle), heartbeats = %s\n", sources_count, idle_count,
+	       heartbeats ? "on" : "off");
+	printf("merged = %llu records, %.3f Mrec/sec, %.3f sec\n", merged,
+	       merged / (elapsed * 1E-9) * 1E-6, elapsed * 1E-9);
+	printf("not ready = %llu, errors = %llu\n", not_ready, errors);
+
+	for (i = 0; i < sources_count; i++)
+		fifo_destroy(fifos[i]);
+	free(m);
+	return errors ? 1 : 0;
+}
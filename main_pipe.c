@@ -10,12 +10,29 @@
 #include <sys/syscall.h>
 #include <errno.h>
 
+#include "perf.h"
+#include "workload.h"
+
 #ifdef JUST_MEMCPY
-#define nrand48(dummy) 0
+#define DEFAULT_WORKLOAD "none"
+#else
+#define DEFAULT_WORKLOAD "nrand48"
 #endif
 
 static
 int setaffinity;
+static
+int use_perf;
+static
+const struct workload *workload;
+
+/* read(2)/write(2) calls are pipe's counterpart of fifo exchanges */
+static
+struct perf_counters reader_perf, writer_perf;
+static
+uint64_t reader_calls, writer_calls;
+static
+uint64_t bytes_read;
 
 #define BUFFERSIZE 32768
 #define SEND_BYTES 2000000000U
@@ -56,61 +73,85 @@ static
 void *reader_thread(void *dummy)
 {
 	unsigned long long count=0;
-	int sum=0;
-	unsigned short xsubi[3];
-	memset(xsubi, 0, sizeof(xsubi));
+	unsigned unit = workload->unit;
+	struct workload_state state;
+	memset(&state, 0, sizeof(state));
 
 	printf("reader's pid is %d\n", gettid());
 	if (setaffinity)
 		move_to_cpu(0);
 
-	while (1) {
-		unsigned len, i;
+	if (use_perf)
+		perf_counters_open(&reader_perf);
 
-		len = read(read_fd, reader_buffer, BUFFERSIZE);
+	while (1) {
+		ssize_t rv;
+		unsigned len = 0;
+
+		/* workload processes whole units, so complete partial
+		 * read */
+		do {
+			rv = read(read_fd, (char *)reader_buffer + len, BUFFERSIZE - len);
+			reader_calls++;
+			if (rv < 0 && errno != EINTR)
+				fatal_perror("read");
+			if (rv > 0)
+				len += rv;
+		} while (rv < 0 || (rv > 0 && len % unit));
 		if (len == 0)
 			break;
 
-		len /= sizeof(int);
-
-		for (i = 0; i < len; i++, count++)
-			sum |= reader_buffer[i] ^  nrand48(xsubi);
+		workload->consume(&state, reader_buffer, len, count);
+		count += len;
 	}
-	printf("sum = 0x%08x\ncount = %lld\n", sum, count);
-	return (void *)(intptr_t)sum;
+	if (use_perf)
+		perf_counters_close(&reader_perf);
+	bytes_read = count;
+	printf("acc = 0x%016llx\nerrors = %llu\ncount = %lld\n",
+	       (unsigned long long)state.acc, (unsigned long long)state.errors, count);
+	return 0;
 }
 
 static
 void *writer_thread(void *dummy)
 {
-	unsigned count = 0;
-	unsigned short xsubi[3];
-	memset(xsubi, 0, sizeof(xsubi));
+	unsigned long long count = 0;
+	unsigned long long total = (unsigned long long)SEND_BYTES*sizeof(int);
+	struct workload_state state;
+	memset(&state, 0, sizeof(state));
 
+	total -= total % workload->unit;
 	printf("writer's pid is %d\n", gettid());
 	if (setaffinity)
 		move_to_cpu(1);
 
-	while (count < SEND_BYTES) {
+	if (use_perf)
+		perf_counters_open(&writer_perf);
+
+	while (count < total) {
 		unsigned len, i;
+		ssize_t rv;
 
-		len = BUFFERSIZE/sizeof(int);
-		len = (len > SEND_BYTES - count) ? SEND_BYTES - count : len;
+		len = BUFFERSIZE;
+		len = (len > total - count) ? total - count : len;
+		len -= len % workload->unit;
+		workload->produce(&state, writer_buffer, len, count);
 		count += len;
-		for (i=0;i<len;i++)
-			writer_buffer[i] = nrand48(xsubi);
-		i *= sizeof(int);
-		while (i > 0) {
-			len = write(write_fd, writer_buffer, i);
-			if (len < 0) {
+		i = 0;
+		while (i < len) {
+			rv = write(write_fd, (char *)writer_buffer + i, len - i);
+			writer_calls++;
+			if (rv < 0) {
 				if (errno == EINTR)
 					continue;
 				fatal_perror("write");
 			}
-			i -= len;
+			i += rv;
 		}
 	}
 	close(write_fd);
+	if (use_perf)
+		perf_counters_close(&writer_perf);
 	return 0;
 }
 
@@ -119,12 +160,16 @@ char *usage_text =
 	"Usage: %s [options]\n"
 	"Benchmark in-kernel pipe fifo implementation.\n"
 	"  -a\tset affinity for dual- core or CPU machine\n"
+	"  -P\tcollect per-thread perf_event counters\n"
+	"  -w workload\tdata processing run on every buffer (default %s)\n"
 	"\n";
 
 static
 void usage(char **argv)
 {
-	fprintf(stderr, usage_text, argv[0]);
+	fprintf(stderr, usage_text, argv[0], DEFAULT_WORKLOAD);
+	fprintf(stderr, "Workloads:\n");
+	workload_list(stderr);
 }
 
 int main(int argc, char **argv)
@@ -134,17 +179,31 @@ int main(int argc, char **argv)
 	int pipes[2];
 	int optchar;
 
-	while ((optchar = getopt(argc, argv, "a")) >= 0) {
+	while ((optchar = getopt(argc, argv, "aPw:")) >= 0) {
 		switch (optchar) {
 		case 'a':
 			setaffinity = 1;
 			break;
+		case 'P':
+			use_perf = 1;
+			break;
+		case 'w':
+			workload = workload_find(optarg);
+			if (!workload) {
+				fprintf(stderr, "unknown workload %s, available workloads:\n", optarg);
+				workload_list(stderr);
+				exit(1);
+			}
+			break;
 		default:
 			usage(argv);
 			exit(1);
 		}
 	}
 
+	if (!workload)
+		workload = workload_find(DEFAULT_WORKLOAD);
+
 	rv = pipe(pipes);
 	if (rv)
 		fatal_perror("pipe");
@@ -162,5 +221,12 @@ int main(int argc, char **argv)
 	pthread_join(reader, 0);
 	pthread_join(writer, 0);
 
+	printf("read calls = %llu\nwrite calls = %llu\n",
+	       (unsigned long long)reader_calls, (unsigned long long)writer_calls);
+	if (use_perf) {
+		perf_counters_print(stdout, "reader perf", &reader_perf, bytes_read, reader_calls);
+		perf_counters_print(stdout, "writer perf", &writer_perf, bytes_read, writer_calls);
+	}
+
 	return 0;
 }
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fifo.h"
+#include "pipeline.h"
+#include "workload.h"
+
+#define DEFAULT_BYTES (1ULL << 30)
+#define BATCH 16384
+#define MAX_MIDDLE (PIPELINE_MAX_STAGES - 2)
+
+/* source -> N xor stages -> sink. Xor is involution, so with even
+ * number of them sink sees data exactly as source produced it and
+ * workload verification still works. Thread xor stages xor input
+ * span into output span (a copy between fifos), fused ones work in
+ * place */
+
+static
+unsigned long long total_bytes = DEFAULT_BYTES;
+static
+const struct workload *workload;
+static
+struct workload_state source_state, sink_state;
+static
+uint64_t source_pos, sink_pos;
+static
+char middle_names[MAX_MIDDLE][16];
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+int source_fn(struct pipeline_stage *stage, struct fifo_window *in, struct fifo_window *out)
+{
+	unsigned len;
+	void *p = fifo_window_peek_span(out, &len);
+
+	if (len > BATCH)
+		len = BATCH;
+	if (len > total_bytes - source_pos)
+		len = total_bytes - source_pos;
+	len -= len % workload->unit;
+	workload->produce(&source_state, p, len, source_pos);
+	fifo_window_eat_span(out, len);
+	source_pos += len;
+	return source_pos == total_bytes;
+}
+
+static
+void xor_bytes(void *dst, const void *src, unsigned len)
+{
+	const uint64_t key = 0x5a5a5a5a5a5a5a5aULL;
+	unsigned i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, (const char *)src + i, 8);
+		v ^= key;
+		memcpy((char *)dst + i, &v, 8);
+	}
+	for (; i < len; i++)
+		((char *)dst)[i] = ((const char *)src)[i] ^ 0x5a;
+}
+
+static
+int xor_stage_fn(struct pipeline_stage *stage, struct fifo_window *in, struct fifo_window *out)
+{
+	while (in->len && out->len) {
+		unsigned in_len, out_len;
+		void *src = fifo_window_peek_span(in, &in_len);
+		void *dst = fifo_window_peek_span(out, &out_len);
+		unsigned len = in_len < out_len ? in_len : out_len;
+
+		if (len > BATCH)
+			len = BATCH;
+		xor_bytes(dst, src, len);
+		fifo_window_eat_span(in, len);
+		fifo_window_eat_span(out, len);
+	}
+	return 0;
+}
+
+static
+void xor_transform(struct pipeline_stage *stage, void *p, unsigned len, uint64_t pos)
+{
+	xor_bytes(p, p, len);
+}
+
+static
+int sink_fn(struct pipeline_stage *stage, struct fifo_window *in, struct fifo_window *out)
+{
+	unsigned len;
+	void *p = fifo_window_peek_span(in, &len);
+
+	if (len > BATCH)
+		len = BATCH;
+	len -= len % workload->unit;
+	workload->consume(&sink_state, p, len, sink_pos);
+	fifo_window_eat_span(in, len);
+	sink_pos += len;
+	return 0;
+}
+
+/* cpu of n-th stage from comma separated list, -1 when list is too
+ * short */
+static
+int parse_cpus(char *arg, int *cpus)
+{
+	char *p;
+	int count = 0;
+
+	for (p = strtok(arg, ","); p && count < PIPELINE_MAX_STAGES; p = strtok(0, ","))
+		cpus[count++] = strtol(p, 0, 0);
+	return count;
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Runs source -> xor stages -> sink pipeline and reports per-stage\n"
+	"throughput and stall times.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -m count\tnumber of xor stages between source and sink, even (default 2).\n"
+	"    \tEach runs in own thread and copies spans into next fifo\n"
+	"  -x\tfuse xor stages into source thread instead, where they\n"
+	"    \trun in place on source output without copying\n"
+	"  -c list\tcomma separated cpus of thread stages (default not pinned)\n"
+	"  -N bytes\tbytes sent through pipeline (default %llu)\n"
+	"  -F size\tfifo size (default %d)\n"
+	"  -w workload\tsource production and sink verification (default prng)\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		DEFAULT_BYTES, FIFO_SIZE);
+	fprintf(stderr, "Workloads:\n");
+	workload_list(stderr);
+}
+
+int main(int argc, char **argv)
+{
+	struct pipeline pipeline;
+	unsigned middle = 2, fifo_size = FIFO_SIZE;
+	int fuse = 0;
+	int cpus[PIPELINE_MAX_STAGES];
+	int cpus_count = 0, stage = 0;
+	unsigned i;
+	int optchar, rv;
+
+	while ((optchar = getopt(argc, argv, "m:xc:N:F:w:")) >= 0) {
+		switch (optchar) {
+		case 'm':
+			middle = strtoul(optarg, 0, 0);
+			break;
+		case 'x':
+			fuse = 1;
+			break;
+		case 'c':
+			cpus_count = parse_cpus(optarg, cpus);
+			break;
+		case 'N':
+			total_bytes = strtoull(optarg, 0, 0);
+			break;
+		case 'F':
+			fifo_size = strtoul(optarg, 0, 0);
+			break;
+		case 'w':
+			workload = workload_find(optarg);
+			if (!workload) {
+				usage(argv);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+	if (middle > MAX_MIDDLE || (middle & 1)) {
+		fprintf(stderr, "number of xor stages must be even and at most %d\n", MAX_MIDDLE);
+		exit(1);
+	}
+	if (!workload)
+		workload = workload_find("prng");
+	total_bytes -= total_bytes % workload->unit;
+
+#define NEXT_CPU() (stage < cpus_count ? cpus[stage++] : -1)
+	pipeline_init(&pipeline, fifo_size);
+	pipeline_add_stage(&pipeline, "source", source_fn, 0, NEXT_CPU());
+	for (i = 0; i < middle; i++) {
+		snprintf(middle_names[i], sizeof(middle_names[i]), "xor%u", i);
+		if (fuse)
+			pipeline_add_transform(&pipeline, middle_names[i], xor_transform, 0);
+		else
+			pipeline_add_stage(&pipeline, middle_names[i], xor_stage_fn, 0, NEXT_CPU());
+	}
+	pipeline_add_stage(&pipeline, "sink", sink_fn, 0, NEXT_CPU());
+#undef NEXT_CPU
+
+	rv = pipeline_run(&pipeline);
+	if (rv) {
+		errno = rv;
+		fatal_perror("pipeline_run");
+	}
+	pipeline_report(&pipeline, stdout);
+	printf("workload = %s, acc = 0x%016llx, errors = %llu, bytes = %llu\n", workload->name,
+	       (unsigned long long)sink_state.acc, (unsigned long long)sink_state.errors,
+	       (unsigned long long)sink_pos);
+	pipeline_destroy(&pipeline);
+	return 0;
+}
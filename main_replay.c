@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "fifo.h"
+#include "workload.h"
+
+#define CHUNK 65536
+
+static
+char *ring_path;
+static
+int replay_all;
+static
+int commit;
+static
+int check;
+static
+unsigned fifo_size = FIFO_SIZE;
+static
+const struct workload *workload;
+
+static
+struct shm_fifo *ring, *fifo;
+static
+unsigned replay_start, replay_end, persisted_tail;
+static
+struct workload_state reader_state;
+static
+unsigned long long replayed;
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+/* consumes recorded bytes through reader window of ring, the way
+ * restarted consumer would, and copies them into fresh fifo */
+static
+void *writer_thread(void *dummy)
+{
+	struct fifo_window in, out;
+	unsigned left = replay_end - replay_start;
+
+	fifo_window_init_reader(ring, &in, 0, ring->size);
+	fifo_window_init_writer(fifo, &out, 1, fifo->size);
+	while (left) {
+		unsigned len;
+		void *p;
+
+		/* ring has no writer, everything is there already */
+		if (!in.len)
+			fifo_window_exchange_reader(&in);
+		p = fifo_window_peek_span(&in, &len);
+		if (len > left)
+			len = left;
+		if (len > CHUNK)
+			len = CHUNK;
+		fifo_window_exchange_writer(&out);
+		if (len > out.len)
+			len = out.len;
+		fifo_window_put(&out, p, len);
+		fifo_window_eat_span(&in, len);
+		left -= len;
+	}
+	fifo_window_exchange_reader(&in);
+	fifo_window_close_writer(&out);
+	return 0;
+}
+
+static
+void *reader_thread(void *dummy)
+{
+	struct fifo_window window;
+	unsigned long long pos = replay_start;
+	unsigned long long count = 0;
+	unsigned unit = workload->unit;
+
+	fifo_window_init_reader(fifo, &window, 0, fifo->size);
+	while (1) {
+		int closed = fifo_window_writer_closed(&window);
+		unsigned len;
+		void *p;
+
+		fifo_window_exchange_reader(&window);
+		if (window.len < unit) {
+			if (closed)
+				break;
+			fifo_window_reader_wait(&window);
+			continue;
+		}
+		p = fifo_window_peek_span(&window, &len);
+		len -= len % unit;
+		if (!len) {
+			/* unit straddles end of fifo data, can only happen
+			 * when recorded stream doesn't start at multiple of
+			 * unit */
+			fprintf(stderr, "replay isn't aligned to %u byte unit of workload\n", unit);
+			exit(1);
+		}
+		workload->consume(&reader_state, p, len, pos);
+		fifo_window_eat_span(&window, len);
+		pos += len;
+		count += len;
+	}
+	replayed = count;
+	return 0;
+}
+
+#define CHECK_SYNC_BYTES 4096
+
+/* pushes chunk of workload data through writer window */
+static
+void check_produce(struct fifo_window *w, struct workload_state *st, uint64_t *pos, unsigned len)
+{
+	fifo_window_exchange_writer(w);
+	if (len > w->len)
+		len = w->len;
+	while (len) {
+		unsigned span;
+		void *p = fifo_window_peek_span(w, &span);
+		if (span > len)
+			span = len;
+		workload->produce(st, p, span, *pos);
+		fifo_window_eat_span(w, span);
+		*pos += span;
+		len -= span;
+	}
+	fifo_window_exchange_writer(w);
+}
+
+/* consumes up to len published bytes through reader window */
+static
+void check_consume(struct fifo_window *r, struct workload_state *st, uint64_t *pos, unsigned len)
+{
+	fifo_window_exchange_reader(r);
+	if (len > r->len)
+		len = r->len;
+	while (len) {
+		unsigned span;
+		void *p = fifo_window_peek_span(r, &span);
+		if (span > len)
+			span = len;
+		workload->consume(st, p, span, *pos);
+		fifo_window_eat_span(r, span);
+		*pos += span;
+		len -= span;
+	}
+	fifo_window_exchange_reader(r);
+}
+
+/* write/close/reopen/read round trip through windows. Positions run
+ * past fifo size before reopen, so reopened windows start at
+ * free-running positions, and writer keeps going after reopen too.
+ * Returns number of errors */
+static
+int round_trip_check(char *path)
+{
+	struct workload_state produce_state, consume_state;
+	struct fifo_window w, r;
+	uint64_t produced = 0, consumed = 0;
+	unsigned size = fifo_size;
+	unsigned chunk = size / 4;
+	int errors = 0, rv, i;
+
+	memset(&produce_state, 0, sizeof(produce_state));
+	memset(&consume_state, 0, sizeof(consume_state));
+	chunk -= chunk % workload->unit;
+	unlink(path);
+
+	rv = fifo_open_persistent(&ring, path, size, CHECK_SYNC_BYTES);
+	if (rv) {
+		errno = rv;
+		fatal_perror(path);
+	}
+	fifo_window_init_writer(ring, &w, 0, size);
+	fifo_window_init_reader(ring, &r, 0, size);
+	for (i = 0; i < 10; i++) {
+		check_produce(&w, &produce_state, &produced, chunk);
+		check_consume(&r, &consume_state, &consumed, chunk);
+	}
+	/* leave some unread */
+	check_produce(&w, &produce_state, &produced, chunk);
+	fifo_window_close_writer(&w);
+	fifo_destroy(ring);
+
+	rv = fifo_open_persistent(&ring, path, 0, CHECK_SYNC_BYTES);
+	if (rv) {
+		errno = rv;
+		fatal_perror(path);
+	}
+	printf("round trip: reopened at head %u, tail %u (size %u)\n",
+	       ring->head, ring->tail, ring->size);
+	if (ring->head != (unsigned)produced || ring->tail != (unsigned)consumed) {
+		fprintf(stderr, "round trip: expected head %u, tail %u\n",
+			(unsigned)produced, (unsigned)consumed);
+		errors++;
+	}
+	fifo_window_init_writer(ring, &w, 0, ring->size);
+	fifo_window_init_reader(ring, &r, 0, ring->size);
+	check_produce(&w, &produce_state, &produced, chunk);
+	while (consumed != produced) {
+		uint64_t before = consumed;
+		check_consume(&r, &consume_state, &consumed, chunk);
+		if (consumed == before) {
+			fprintf(stderr, "round trip: stuck at %llu of %llu\n",
+				(unsigned long long)consumed, (unsigned long long)produced);
+			errors++;
+			break;
+		}
+	}
+	fifo_window_close_writer(&w);
+	fifo_destroy(ring);
+	unlink(path);
+
+	errors += consume_state.errors;
+	printf("round trip: %llu bytes, workload = %s, errors = %d\n",
+	       (unsigned long long)consumed, workload->name, errors);
+	return errors;
+}
+
+static
+char *usage_text =
+	"Usage: %s [options] -f ring-file\n"
+	"Streams data recorded in persistent fifo into fresh fifo at full speed.\n"
+	"By default unconsumed data between persisted tail and durable head is\n"
+	"replayed.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -f file\tpersistent fifo file (e.g. recorded with main_* -p)\n"
+	"  -a\treplay all retained history (up to fifo size bytes before head,\n"
+	"    \tbut not below tail if writer didn't close ring cleanly)\n"
+	"  -c\tmark replayed data consumed in ring file\n"
+	"  -F size\tsize of fresh fifo (default %d)\n"
+	"  -w workload\tverify/process replayed data (default none, prng for -C)\n"
+	"  -C\tcheck write/close/reopen/read round trip on scratch file given by -f\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type, FIFO_SIZE);
+	fprintf(stderr, "Workloads:\n");
+	workload_list(stderr);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t reader, writer;
+	double start, seconds;
+	int optchar;
+	int rv;
+
+	while ((optchar = getopt(argc, argv, "f:acCF:w:")) >= 0) {
+		switch (optchar) {
+		case 'f':
+			ring_path = optarg;
+			break;
+		case 'a':
+			replay_all = 1;
+			break;
+		case 'c':
+			commit = 1;
+			break;
+		case 'C':
+			check = 1;
+			break;
+		case 'F':
+			fifo_size = strtoul(optarg, 0, 0);
+			break;
+		case 'w':
+			workload = workload_find(optarg);
+			if (!workload) {
+				usage(argv);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+	if (!ring_path) {
+		usage(argv);
+		exit(1);
+	}
+	if (!workload)
+		workload = workload_find(check ? "prng" : "none");
+	if (check)
+		return round_trip_check(ring_path) ? 1 : 0;
+
+	/* sync_bytes is irrelevant, ring isn't written */
+	rv = fifo_open_persistent(&ring, ring_path, 0, 0);
+	if (rv) {
+		errno = rv;
+		fatal_perror(ring_path);
+	}
+	rv = fifo_create_sized(&fifo, fifo_size);
+	if (rv) {
+		errno = rv;
+		fatal_perror("fifo_create");
+	}
+
+	replay_end = ring->head;
+	replay_start = ring->tail;
+	if (replay_all) {
+		replay_start = replay_end - ((replay_end < ring->size) ? replay_end : ring->size);
+		if ((int)(ring->history_start - replay_start) > 0) {
+			printf("ring wasn't closed cleanly, history before %u is lost\n",
+			       ring->history_start);
+			replay_start = ring->history_start;
+		}
+	}
+	printf("ring %s: size %u, tail %u, durable head %u, replaying %u bytes\n",
+	       ring_path, ring->size, ring->tail, ring->head, replay_end - replay_start);
+	/* reader window consumes from tail, so history is replayed by
+	 * rewinding it. It's put back afterwards unless -c */
+	persisted_tail = ring->tail;
+	ring->tail = replay_start;
+
+	start = now();
+	rv = pthread_create(&reader, 0, reader_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&reader)");
+	rv = pthread_create(&writer, 0, writer_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&writer)");
+	pthread_join(writer, 0);
+	pthread_join(reader, 0);
+	seconds = now() - start;
+
+	printf("%llu bytes, %.3f sec, %.3f GB/s\n", replayed, seconds, replayed / seconds * 1E-9);
+	printf("workload = %s, acc = 0x%016llx, errors = %llu\n", workload->name,
+	       (unsigned long long)reader_state.acc, (unsigned long long)reader_state.errors);
+
+	if (!commit)
+		ring->tail = persisted_tail;
+	fifo_destroy(fifo);
+	fifo_destroy(ring);
+	return 0;
+}
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "fifo.h"
+#include "channel.h"
+#include "hist.h"
+
+#define MAX_MESSAGE 32768
+#define DEFAULT_SIZE 64
+#define DEFAULT_ITERATIONS 100000
+#define WARMUP_ITERATIONS 1000
+#define MAX_DEPTHS 16
+#define SOCK_BUFFER 65536
+
+static
+int setaffinity;
+static
+int use_unix;
+static
+unsigned iterations = DEFAULT_ITERATIONS;
+static
+unsigned message_size = DEFAULT_SIZE;
+static
+unsigned depths[MAX_DEPTHS] = {1, 4, 16};
+static
+unsigned depths_count = 3;
+
+static
+struct channel channel;
+static
+int sock_fds[2];
+
+/* baseline: same framing as channel over unix stream socket, with
+ * user space buffering so that batching works the same way */
+struct sock_endpoint {
+	int fd;
+	unsigned in_start, in_end;
+	unsigned out_len;
+	char in[SOCK_BUFFER];
+	char out[SOCK_BUFFER];
+};
+
+/* either channel or socket endpoint, depending on use_unix */
+struct endpoint {
+	struct channel_endpoint ch;
+	struct sock_endpoint *sock;
+};
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+pid_t gettid(void)
+{
+	return syscall(__NR_gettid);
+}
+
+static
+void move_to_cpu(int number)
+{
+	pid_t tid = gettid();
+	cpu_set_t set;
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(number, &set);
+	rv = sched_setaffinity(tid, sizeof(set), &set);
+	if (rv < 0)
+		fatal_perror("sched_setaffinity");
+}
+
+static
+uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void full_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t rv = write(fd, p, len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("write");
+		}
+		p += rv;
+		len -= rv;
+	}
+}
+
+static
+void sock_flush(struct sock_endpoint *se)
+{
+	full_write(se->fd, se->out, se->out_len);
+	se->out_len = 0;
+}
+
+static
+void sock_send(struct sock_endpoint *se, uint64_t id, uint32_t flags,
+	       const void *buf, unsigned len)
+{
+	struct channel_header hdr;
+	unsigned size = CHANNEL_MESSAGE_SIZE(len);
+
+	if (se->out_len + size > SOCK_BUFFER)
+		sock_flush(se);
+	hdr.len = len;
+	hdr.flags = flags;
+	hdr.id = id;
+	memcpy(se->out + se->out_len, &hdr, sizeof(hdr));
+	memcpy(se->out + se->out_len + sizeof(hdr), buf, len);
+	se->out_len += size;
+}
+
+/* returns size of complete message at start of input buffer or 0 */
+static
+unsigned sock_buffered(struct sock_endpoint *se)
+{
+	struct channel_header hdr;
+	unsigned avail = se->in_end - se->in_start;
+
+	if (avail < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, se->in + se->in_start, sizeof(hdr));
+	return avail >= CHANNEL_MESSAGE_SIZE(hdr.len) ? CHANNEL_MESSAGE_SIZE(hdr.len) : 0;
+}
+
+static
+int sock_recv(struct sock_endpoint *se, struct channel_header *hdr, void *buf)
+{
+	unsigned size;
+
+	while (!(size = sock_buffered(se))) {
+		ssize_t rv;
+
+		memmove(se->in, se->in + se->in_start, se->in_end - se->in_start);
+		se->in_end -= se->in_start;
+		se->in_start = 0;
+		rv = read(se->fd, se->in + se->in_end, SOCK_BUFFER - se->in_end);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("read");
+		}
+		if (rv == 0)
+			return -EPIPE;
+		se->in_end += rv;
+	}
+	memcpy(hdr, se->in + se->in_start, sizeof(*hdr));
+	memcpy(buf, se->in + se->in_start + sizeof(*hdr), hdr->len);
+	se->in_start += size;
+	return hdr->len;
+}
+
+static
+void endpoint_send(struct endpoint *ep, uint64_t id, const void *buf, unsigned len)
+{
+	if (ep->sock)
+		sock_send(ep->sock, id, 0, buf, len);
+	else if (channel_send(&ep->ch, id, 0, buf, len))
+		fatal_perror("channel_send");
+}
+
+static
+void endpoint_flush(struct endpoint *ep)
+{
+	if (ep->sock)
+		sock_flush(ep->sock);
+	else
+		channel_flush(&ep->ch);
+}
+
+static
+int endpoint_recv(struct endpoint *ep, struct channel_header *hdr, void *buf)
+{
+	if (ep->sock)
+		return sock_recv(ep->sock, hdr, buf);
+	return channel_recv(&ep->ch, hdr, buf, MAX_MESSAGE);
+}
+
+static
+int endpoint_readable(struct endpoint *ep)
+{
+	if (ep->sock)
+		return sock_buffered(ep->sock) != 0;
+	return channel_readable(&ep->ch);
+}
+
+static
+void endpoint_init(struct endpoint *ep, int server)
+{
+	if (use_unix) {
+		ep->sock = calloc(1, sizeof(*ep->sock));
+		if (!ep->sock)
+			fatal_perror("calloc");
+		ep->sock->fd = sock_fds[server];
+	} else {
+		ep->sock = 0;
+		if (server)
+			channel_server_init(&channel, &ep->ch);
+		else
+			channel_client_init(&channel, &ep->ch);
+	}
+}
+
+static
+void endpoint_close(struct endpoint *ep)
+{
+	if (ep->sock) {
+		sock_flush(ep->sock);
+		shutdown(ep->sock->fd, SHUT_WR);
+		free(ep->sock);
+	} else {
+		channel_close(&ep->ch);
+	}
+}
+
+/* echoes requests, responses to everything received so far are
+ * flushed together when there's no more input */
+static
+void *server_thread(void *dummy)
+{
+	static char buf[MAX_MESSAGE];
+	struct channel_header hdr;
+	struct endpoint ep;
+	int len;
+
+	if (setaffinity)
+		move_to_cpu(1);
+
+	endpoint_init(&ep, 1);
+	while ((len = endpoint_recv(&ep, &hdr, buf)) >= 0) {
+		endpoint_send(&ep, hdr.id, buf, len);
+		if (!endpoint_readable(&ep))
+			endpoint_flush(&ep);
+	}
+	endpoint_close(&ep);
+	return 0;
+}
+
+/* keeps depth requests outstanding. Latency of every call is time
+ * from queueing request to receiving its response */
+static
+void run_depth(struct endpoint *ep, unsigned depth, struct hist *h, double *calls_per_sec)
+{
+	static char msg[MAX_MESSAGE], reply[MAX_MESSAGE];
+	uint64_t *sent_at = calloc(depth, sizeof(uint64_t));
+	uint64_t total = iterations + WARMUP_ITERATIONS;
+	uint64_t sent = 0, received = 0;
+	uint64_t start = 0;
+
+	if (!sent_at)
+		fatal_perror("calloc");
+	memset(msg, 0x5a, message_size);
+	hist_reset(h);
+
+	while (received < total) {
+		struct channel_header hdr;
+		uint64_t now;
+		int len;
+
+		while (sent < total && sent - received < depth) {
+			sent_at[sent % depth] = clock_ns();
+			endpoint_send(ep, sent, msg, message_size);
+			sent++;
+		}
+		endpoint_flush(ep);
+
+		len = endpoint_recv(ep, &hdr, reply);
+		if (len != (int)message_size || hdr.id < received || hdr.id >= sent) {
+			fprintf(stderr, "bad response: len %d id %llu\n", len, (unsigned long long)hdr.id);
+			exit(1);
+		}
+		now = clock_ns();
+		if (received == WARMUP_ITERATIONS)
+			start = now;
+		if (received >= WARMUP_ITERATIONS)
+			hist_record(h, now - sent_at[hdr.id % depth]);
+		received++;
+	}
+	*calls_per_sec = iterations / ((clock_ns() - start) * 1E-9);
+	free(sent_at);
+}
+
+static
+void *client_thread(void *dummy)
+{
+	struct endpoint ep;
+	struct hist *h = malloc(sizeof(*h));
+	unsigned i;
+
+	if (!h)
+		fatal_perror("malloc");
+	if (setaffinity)
+		move_to_cpu(0);
+
+	endpoint_init(&ep, 0);
+	for (i = 0; i < depths_count; i++) {
+		char label[64];
+		double calls_per_sec;
+
+		run_depth(&ep, depths[i], h, &calls_per_sec);
+		snprintf(label, sizeof(label), "%s rpc ns size=%u depth=%u",
+			 use_unix ? "unix" : "channel", message_size, depths[i]);
+		hist_print(stdout, label, h);
+		printf("%s calls/s = %.0f\n", label, calls_per_sec);
+	}
+	endpoint_close(&ep);
+
+	free(h);
+	return 0;
+}
+
+static
+void parse_depths(char *arg)
+{
+	char *p;
+
+	depths_count = 0;
+	for (p = strtok(arg, ","); p; p = strtok(0, ",")) {
+		unsigned depth = strtoul(p, 0, 0);
+		if (depths_count == MAX_DEPTHS || depth == 0) {
+			fprintf(stderr, "up to %d depths, each at least 1\n", MAX_DEPTHS);
+			exit(1);
+		}
+		depths[depths_count++] = depth;
+	}
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Request/response latency and throughput over duplex channel.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -a\tset affinity for dual- core or CPU machine\n"
+	"  -b unix\tunix stream socket baseline with same framing\n"
+	"  -s size\tpayload bytes per request and response (default %d)\n"
+	"  -d list\tcomma separated numbers of outstanding requests (default 1,4,16)\n"
+	"  -n count\tcalls per depth (default %u)\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		DEFAULT_SIZE, DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+	int rv;
+	pthread_t client, server;
+	int optchar;
+	unsigned i;
+
+	while ((optchar = getopt(argc, argv, "ab:s:d:n:")) >= 0) {
+		switch (optchar) {
+		case 'a':
+			setaffinity = 1;
+			break;
+		case 'b':
+			if (strcmp(optarg, "unix")) {
+				usage(argv);
+				exit(1);
+			}
+			use_unix = 1;
+			break;
+		case 's':
+			message_size = strtoul(optarg, 0, 0);
+			break;
+		case 'd':
+			parse_depths(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+
+	if (message_size > MAX_MESSAGE) {
+		fprintf(stderr, "message size must be at most %d\n", MAX_MESSAGE);
+		exit(1);
+	}
+	/* requests of whole pipeline must fit into fifo, see
+	 * channel_send */
+	for (i = 0; i < depths_count; i++)
+		if (depths[i] * CHANNEL_MESSAGE_SIZE(message_size) > FIFO_SIZE) {
+			fprintf(stderr, "depth %u of %u byte messages doesn't fit into %d byte fifo\n",
+				depths[i], message_size, (int)FIFO_SIZE);
+			exit(1);
+		}
+
+	printf("transport = %s", use_unix ? "unix" : "channel");
+	if (!use_unix)
+		printf(" (%s)", fifo_implementation_type);
+	printf("\n");
+
+	if (use_unix) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fds))
+			fatal_perror("socketpair");
+	} else {
+		rv = channel_create(&channel, FIFO_SIZE);
+		if (rv) {
+			errno = rv;
+			fatal_perror("channel_create");
+		}
+	}
+
+	rv = pthread_create(&server, 0, server_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&server)");
+
+	rv = pthread_create(&client, 0, client_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&client)");
+
+	pthread_join(client, 0);
+	pthread_join(server, 0);
+
+	if (!use_unix) {
+		channel_destroy(&channel);
+		printf("fifo_reader_wake_count = %lld\n", (long long)fifo_reader_wake_count);
+		printf("fifo_writer_wake_count = %lld\n", (long long)fifo_writer_wake_count);
+		printf("fifo_reader_wait_calls = %lld\n", (long long)fifo_reader_wait_calls);
+	}
+
+	return 0;
+}
@@ -0,0 +1,626 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+#include "fifo.h"
+
+#define MAX_PAIRS 256
+#define MAX_CPUS 1024
+#define DEFAULT_BYTES (1U << 30)
+#define DEFAULT_BATCH 8192
+
+enum topology {
+	TOPOLOGY_NONE,
+	TOPOLOGY_SMT,		/* reader and writer on SMT siblings */
+	TOPOLOGY_SOCKET,	/* different cores of same socket */
+	TOPOLOGY_CROSS,		/* reader and writer on different sockets */
+};
+
+static
+char *topology_names[] = {"none", "smt", "socket", "cross"};
+
+/* where fifo memory of pair goes */
+enum placement {
+	PLACEMENT_FIRST_TOUCH,	/* data pages land on writer's node */
+	PLACEMENT_READER,
+	PLACEMENT_WRITER,
+	PLACEMENT_INTERLEAVE,
+};
+
+static
+char *placement_names[] = {"default", "reader", "writer", "interleave"};
+
+struct cpu_info {
+	int cpu;
+	int core;
+	int package;
+	int used;
+};
+
+struct pair {
+	struct shm_fifo *fifo;
+	int reader_cpu, writer_cpu;
+	int node;		/* fifo memory node, -1 if not bound */
+	double start, end;
+	uint64_t bytes;
+	uint64_t sum;
+	struct fifo_window_stats reader_stats, writer_stats;
+};
+
+static
+struct pair pairs[MAX_PAIRS];
+static
+unsigned pairs_count = 1;
+static
+enum topology topology = TOPOLOGY_SOCKET;
+static
+enum placement placement = PLACEMENT_FIRST_TOUCH;
+static
+uint64_t bytes_per_pair = DEFAULT_BYTES;
+static
+unsigned batch = DEFAULT_BATCH;
+
+static
+unsigned idle_count;
+static
+unsigned idle_burst = FIFO_SIZE;
+static
+int reclaim_ms = -1;
+static
+int reclaim_lazy;
+
+static
+struct cpu_info cpus[MAX_CPUS];
+static
+unsigned cpus_count;
+
+static
+pthread_barrier_t start_barrier;
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+pid_t gettid(void)
+{
+	return syscall(__NR_gettid);
+}
+
+static
+void move_to_cpu(int number)
+{
+	pid_t tid = gettid();
+	cpu_set_t set;
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(number, &set);
+	rv = sched_setaffinity(tid, sizeof(set), &set);
+	if (rv < 0)
+		fatal_perror("sched_setaffinity");
+}
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static
+int read_sysfs_int(int cpu, const char *name)
+{
+	char path[128];
+	FILE *f;
+	int value = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &value) != 1)
+		value = -1;
+	fclose(f);
+	return value;
+}
+
+/* collects core and package ids of cpus we're allowed to run on */
+static
+void read_topology(void)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		fatal_perror("sched_getaffinity");
+
+	for (cpu = 0; cpu < CPU_SETSIZE && cpus_count < MAX_CPUS; cpu++) {
+		struct cpu_info *info;
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		info = &cpus[cpus_count++];
+		info->cpu = cpu;
+		info->core = read_sysfs_int(cpu, "core_id");
+		info->package = read_sysfs_int(cpu, "physical_package_id");
+		info->used = 0;
+		/* no topology in sysfs: treat each cpu as separate core */
+		if (info->core < 0)
+			info->core = cpu;
+		if (info->package < 0)
+			info->package = 0;
+	}
+}
+
+/* returns first unused cpu matching constraints. core < 0 and
+ * package < 0 are wildcards, avoid_core/avoid_package reject cpus on
+ * given core/package. Whole core is marked used unless keep_siblings
+ * is set */
+static
+struct cpu_info *take_cpu(int core, int package, int avoid_core, int avoid_package,
+			  int keep_siblings)
+{
+	unsigned i, j;
+
+	for (i = 0; i < cpus_count; i++) {
+		struct cpu_info *info = &cpus[i];
+		if (info->used)
+			continue;
+		if (core >= 0 && info->core != core)
+			continue;
+		if (package >= 0 && info->package != package)
+			continue;
+		if (avoid_package >= 0 && info->package == avoid_package)
+			continue;
+		if (avoid_core >= 0 && info->core == avoid_core &&
+		    (avoid_package < 0 || info->package == avoid_package))
+			continue;
+		info->used = 1;
+		if (!keep_siblings)
+			for (j = 0; j < cpus_count; j++)
+				if (cpus[j].core == info->core && cpus[j].package == info->package)
+					cpus[j].used = 1;
+		return info;
+	}
+	return 0;
+}
+
+static
+int plan_pair(struct pair *p)
+{
+	struct cpu_info *r, *w;
+
+	switch (topology) {
+	case TOPOLOGY_NONE:
+		p->reader_cpu = p->writer_cpu = -1;
+		return 0;
+	case TOPOLOGY_SMT:
+		for (r = take_cpu(-1, -1, -1, -1, 1); r; r = take_cpu(-1, -1, -1, -1, 1)) {
+			w = take_cpu(r->core, r->package, -1, -1, 1);
+			if (w)
+				break;
+		}
+		break;
+	case TOPOLOGY_SOCKET:
+		r = take_cpu(-1, -1, -1, -1, 0);
+		w = r ? take_cpu(-1, r->package, r->core, r->package, 0) : 0;
+		break;
+	case TOPOLOGY_CROSS:
+		r = take_cpu(-1, -1, -1, -1, 0);
+		w = r ? take_cpu(-1, -1, -1, r->package, 0) : 0;
+		break;
+	default:
+		return -1;
+	}
+	if (!r || !w)
+		return -1;
+	p->reader_cpu = r->cpu;
+	p->writer_cpu = w->cpu;
+	return 0;
+}
+
+static
+void plan_topology(void)
+{
+	unsigned i, fit;
+
+	read_topology();
+	for (i = 0; i < pairs_count; i++)
+		if (plan_pair(&pairs[i]))
+			break;
+
+	fit = i;
+	if (fit == 0) {
+		fprintf(stderr, "no cpus for %s topology on this machine\n",
+			topology_names[topology]);
+		exit(1);
+	}
+	if (fit < pairs_count)
+		fprintf(stderr, "warning: only %u pairs fit %s topology, oversubscribing\n",
+			fit, topology_names[topology]);
+
+	/* ran out of matching cpus: start reusing them */
+	for (; i < pairs_count; i++) {
+		pairs[i].reader_cpu = pairs[i % fit].reader_cpu;
+		pairs[i].writer_cpu = pairs[i % fit].writer_cpu;
+	}
+}
+
+static
+void create_pair_fifo(struct pair *p)
+{
+	int policy = FIFO_NUMA_NODE;
+	int rv;
+
+	p->node = -1;
+	switch (placement) {
+	case PLACEMENT_FIRST_TOUCH:
+		policy = FIFO_NUMA_DEFAULT;
+		break;
+	case PLACEMENT_READER:
+		if (p->reader_cpu >= 0)
+			p->node = fifo_cpu_node(p->reader_cpu);
+		break;
+	case PLACEMENT_WRITER:
+		if (p->writer_cpu >= 0)
+			p->node = fifo_cpu_node(p->writer_cpu);
+		break;
+	case PLACEMENT_INTERLEAVE:
+		policy = FIFO_NUMA_INTERLEAVE;
+		break;
+	}
+	rv = fifo_create_numa(&p->fifo, FIFO_SIZE, 0, policy, p->node);
+	if (rv) {
+		errno = rv;
+		fatal_perror("fifo_create_numa");
+	}
+}
+
+static
+void *reader_thread(void *arg)
+{
+	struct pair *p = arg;
+	struct fifo_window window;
+	uint64_t sum = 0, count = 0;
+
+	if (p->reader_cpu >= 0)
+		move_to_cpu(p->reader_cpu);
+
+	fifo_window_init_reader(p->fifo, &window, 0, FIFO_SIZE);
+	pthread_barrier_wait(&start_barrier);
+	p->start = now();
+
+	while (1) {
+		uint64_t *ptr;
+		unsigned len, i;
+		int closed = fifo_window_writer_closed(&window);
+
+		fifo_window_exchange_reader(&window);
+		if (window.len == 0) {
+			if (closed)
+				break;
+			fifo_window_reader_wait(&window);
+			continue;
+		}
+		ptr = fifo_window_peek_span(&window, &len);
+		if (len > batch)
+			len = batch;
+		fifo_window_eat_span(&window, len);
+		for (i = 0; i < len / sizeof(uint64_t); i++)
+			sum += ptr[i];
+		count += len;
+	}
+
+	p->end = now();
+	p->bytes = count;
+	p->sum = sum;
+	p->reader_stats = window.stats;
+	return 0;
+}
+
+static
+void *writer_thread(void *arg)
+{
+	struct pair *p = arg;
+	struct fifo_window window;
+	uint64_t count = 0;
+
+	if (p->writer_cpu >= 0)
+		move_to_cpu(p->writer_cpu);
+
+	fifo_window_init_writer(p->fifo, &window, sizeof(uint64_t), FIFO_SIZE);
+	pthread_barrier_wait(&start_barrier);
+
+	while (count < bytes_per_pair) {
+		uint64_t *ptr;
+		unsigned len, i;
+
+		fifo_window_exchange_writer(&window);
+		ptr = fifo_window_peek_span(&window, &len);
+		if (len > batch)
+			len = batch;
+		if (len > bytes_per_pair - count)
+			len = bytes_per_pair - count;
+		len &= ~(unsigned)(sizeof(uint64_t) - 1);
+		for (i = 0; i < len / sizeof(uint64_t); i++)
+			ptr[i] = count + i;
+		fifo_window_eat_span(&window, len);
+		count += len;
+	}
+
+	fifo_window_close_writer(&window);
+	p->writer_stats = window.stats;
+	return 0;
+}
+
+static
+long rss_kb(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident = -1;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* many channels that saw one burst of traffic and then went quiet.
+ * Shows resident memory of lazily committed fifos, after burst, and
+ * after writers reclaimed idle fifos */
+static
+void run_idle_channels(void)
+{
+	struct shm_fifo **fifos = calloc(idle_count, sizeof(*fifos));
+	struct fifo_window *readers = calloc(idle_count, sizeof(*readers));
+	struct fifo_window *writers = calloc(idle_count, sizeof(*writers));
+	long rss_base, rss_created, rss_burst, rss_reclaimed = -1;
+	uint64_t reclaimed = 0;
+	unsigned i;
+	int rv;
+
+	if (!fifos || !readers || !writers)
+		fatal_perror("calloc");
+
+	rss_base = rss_kb();
+	for (i = 0; i < idle_count; i++) {
+		rv = fifo_create(&fifos[i]);
+		if (rv)
+			fatal_perror("fifo_create");
+		fifo_window_init_reader(fifos[i], &readers[i], 0, FIFO_SIZE);
+		fifo_window_init_writer(fifos[i], &writers[i], 0, FIFO_SIZE);
+	}
+	rss_created = rss_kb();
+
+	for (i = 0; i < idle_count; i++) {
+		unsigned done = 0;
+
+		while (done < idle_burst) {
+			unsigned len;
+			void *ptr;
+
+			fifo_window_exchange_writer(&writers[i]);
+			ptr = fifo_window_peek_span(&writers[i], &len);
+			if (len > idle_burst - done)
+				len = idle_burst - done;
+			memset(ptr, 0x5a, len);
+			fifo_window_eat_span(&writers[i], len);
+			done += len;
+		}
+		fifo_window_exchange_writer(&writers[i]);
+		fifo_window_exchange_reader(&readers[i]);
+		fifo_window_eat_span(&readers[i], readers[i].len);
+		fifo_window_exchange_reader(&readers[i]);
+	}
+	rss_burst = rss_kb();
+
+	if (reclaim_ms >= 0) {
+		/* first pass starts quiet period, second one (past it
+		 * and coarse clock tick) reclaims */
+		for (i = 0; i < idle_count; i++)
+			fifo_window_reclaim_idle(&writers[i], reclaim_ms, reclaim_lazy);
+		usleep((reclaim_ms + 20) * 1000);
+		for (i = 0; i < idle_count; i++)
+			reclaimed += fifo_window_reclaim_idle(&writers[i], reclaim_ms, reclaim_lazy);
+		rss_reclaimed = rss_kb();
+	}
+
+	printf("idle channels = %u, fifo size = %u, burst = %u\n",
+	       idle_count, (unsigned)FIFO_SIZE, idle_burst);
+	printf("rss kB: before %ld, created %ld (%.1f per channel, fully committed %.1f)\n",
+	       rss_base, rss_created, (double)(rss_created - rss_base) / idle_count,
+	       FIFO_TOTAL_SIZE / 1024.0);
+	printf("rss kB: after burst %ld (%.1f per channel)\n",
+	       rss_burst, (double)(rss_burst - rss_base) / idle_count);
+	if (reclaim_ms >= 0)
+		printf("rss kB: after %s reclaim %ld (%.1f per channel), advised %llu kB\n",
+		       reclaim_lazy ? "MADV_FREE" : "MADV_DONTNEED", rss_reclaimed,
+		       (double)(rss_reclaimed - rss_base) / idle_count,
+		       (unsigned long long)reclaimed / 1024);
+
+	for (i = 0; i < idle_count; i++)
+		fifo_destroy(fifos[i]);
+	free(fifos);
+	free(readers);
+	free(writers);
+}
+
+static
+void print_cpu(int cpu)
+{
+	if (cpu < 0)
+		printf("%4s", "-");
+	else
+		printf("%4d", cpu);
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Runs N independent fifo pairs at once and reports aggregate throughput.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -n pairs\tnumber of reader/writer pairs (default 1, max %d)\n"
+	"  -t topology\tpinning: none, smt, socket (default) or cross\n"
+	"  -m placement\tfifo memory: default (first touch), reader or writer node, interleave\n"
+	"  -s bytes\tbytes sent through every pair (default %u)\n"
+	"  -b bytes\tmax bytes processed per span, rounded down to multiple of 8\n"
+	"    \t(default %u)\n"
+	"  -i count\tfirst create count idle channels and report their resident memory\n"
+	"  -B bytes\tburst written to every idle channel before it goes quiet (default %u)\n"
+	"  -r ms\treclaim idle channels after ms quiet period (default off)\n"
+	"  -z\treclaim with MADV_FREE instead of MADV_DONTNEED\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		MAX_PAIRS, DEFAULT_BYTES, DEFAULT_BATCH, (unsigned)FIFO_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t readers[MAX_PAIRS], writers[MAX_PAIRS];
+	double first_start, last_end;
+	uint64_t total_bytes = 0;
+	int64_t total_wakes = 0;
+	unsigned i;
+	int optchar, rv;
+
+	while ((optchar = getopt(argc, argv, "n:t:m:s:b:i:B:r:z")) >= 0) {
+		switch (optchar) {
+		case 'n':
+			pairs_count = strtoul(optarg, 0, 0);
+			break;
+		case 't':
+			for (i = 0; i < sizeof(topology_names)/sizeof(topology_names[0]); i++)
+				if (!strcmp(optarg, topology_names[i]))
+					break;
+			if (i == sizeof(topology_names)/sizeof(topology_names[0])) {
+				usage(argv);
+				exit(1);
+			}
+			topology = i;
+			break;
+		case 'm':
+			for (i = 0; i < sizeof(placement_names)/sizeof(placement_names[0]); i++)
+				if (!strcmp(optarg, placement_names[i]))
+					break;
+			if (i == sizeof(placement_names)/sizeof(placement_names[0])) {
+				usage(argv);
+				exit(1);
+			}
+			placement = i;
+			break;
+		case 's':
+			bytes_per_pair = strtoull(optarg, 0, 0) & ~(uint64_t)(sizeof(uint64_t) - 1);
+			break;
+		case 'b':
+			batch = strtoul(optarg, 0, 0) & ~(unsigned)(sizeof(uint64_t) - 1);
+			break;
+		case 'i':
+			idle_count = strtoul(optarg, 0, 0);
+			break;
+		case 'B':
+			idle_burst = strtoul(optarg, 0, 0);
+			if (idle_burst > FIFO_SIZE)
+				idle_burst = FIFO_SIZE;
+			break;
+		case 'r':
+			reclaim_ms = strtol(optarg, 0, 0);
+			break;
+		case 'z':
+			reclaim_lazy = 1;
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+
+	if (pairs_count == 0 || pairs_count > MAX_PAIRS || batch < sizeof(uint64_t)) {
+		usage(argv);
+		exit(1);
+	}
+
+	if (idle_count)
+		run_idle_channels();
+
+	plan_topology();
+
+	rv = pthread_barrier_init(&start_barrier, 0, pairs_count * 2);
+	if (rv)
+		fatal_perror("pthread_barrier_init");
+
+	for (i = 0; i < pairs_count; i++)
+		create_pair_fifo(&pairs[i]);
+
+	for (i = 0; i < pairs_count; i++) {
+		rv = pthread_create(&readers[i], 0, reader_thread, &pairs[i]);
+		if (rv)
+			fatal_perror("pthread_create(&reader)");
+		rv = pthread_create(&writers[i], 0, writer_thread, &pairs[i]);
+		if (rv)
+			fatal_perror("pthread_create(&writer)");
+	}
+
+	for (i = 0; i < pairs_count; i++) {
+		pthread_join(readers[i], 0);
+		pthread_join(writers[i], 0);
+	}
+
+	printf("pairs = %u, topology = %s, placement = %s, bytes per pair = %llu\n",
+	       pairs_count, topology_names[topology], placement_names[placement],
+	       (unsigned long long)bytes_per_pair);
+	printf("pair reader writer node     GB/s   rd_exch   wr_exch  rd_wakes  wr_wakes  rd_spins  wr_spins\n");
+
+	first_start = pairs[0].start;
+	last_end = pairs[0].end;
+	for (i = 0; i < pairs_count; i++) {
+		struct pair *p = &pairs[i];
+		double elapsed = p->end - p->start;
+
+		if (p->start < first_start)
+			first_start = p->start;
+		if (p->end > last_end)
+			last_end = p->end;
+		total_bytes += p->bytes;
+		total_wakes += p->reader_stats.wake_count + p->writer_stats.wake_count;
+
+		printf("%4u ", i);
+		print_cpu(p->reader_cpu);
+		printf("   ");
+		print_cpu(p->writer_cpu);
+		printf(" ");
+		print_cpu(p->node);
+		printf(" %8.3f %9lld %9lld %9lld %9lld %9lld %9lld\n",
+		       p->bytes / elapsed * 1E-9,
+		       (long long)p->reader_stats.exchange_count,
+		       (long long)p->writer_stats.exchange_count,
+		       (long long)p->writer_stats.wake_count,
+		       (long long)p->reader_stats.wake_count,
+		       (long long)p->reader_stats.wait_spins,
+		       (long long)p->writer_stats.wait_spins);
+	}
+
+	printf("aggregate = %.3f GB/s over %.3f sec, total wakes = %lld\n",
+	       total_bytes / (last_end - first_start) * 1E-9,
+	       last_end - first_start, (long long)total_wakes);
+
+	return 0;
+}
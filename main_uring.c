@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "fifo.h"
+#include "fifo_uring.h"
+
+#define DEFAULT_FILE_SIZE (256U << 20)
+
+static
+struct shm_fifo *fifo;
+
+static
+int setaffinity;
+static
+int use_uring = 1;
+static
+unsigned depth = 8;
+static
+unsigned chunk = 16384;
+static
+char *input_path = "shm_pipe_uring.dat";
+static
+char *output_path;
+
+static
+int input_fd, output_fd;
+
+static
+int64_t bytes_in, bytes_out;
+static
+uint32_t checksum;
+
+static
+void fatal_perror(char *arg)
+{
+	perror(arg);
+	exit(1);
+}
+
+static
+pid_t gettid(void)
+{
+	return syscall(__NR_gettid);
+}
+
+static
+void move_to_cpu(int number)
+{
+	pid_t tid = gettid();
+	cpu_set_t set;
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(number, &set);
+	rv = sched_setaffinity(tid, sizeof(set), &set);
+	if (rv < 0)
+		fatal_perror("sched_setaffinity");
+}
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+/* creates input file of given size unless it already exists */
+static
+void prepare_input(char *path, off_t size)
+{
+	struct stat st;
+	static char buf[65536];
+	off_t written = 0;
+	int fd;
+
+	if (stat(path, &st) == 0 && st.st_size >= size)
+		return;
+
+	fprintf(stderr, "creating %s (%lld bytes)\n", path, (long long)size);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		fatal_perror("open");
+	while (written < size) {
+		unsigned i;
+		ssize_t rv;
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = (char)(written + i);
+		rv = write(fd, buf, sizeof(buf));
+		if (rv < 0)
+			fatal_perror("write");
+		written += rv;
+	}
+	close(fd);
+}
+
+static
+int64_t pread_ingest(struct fifo_window *window)
+{
+	int64_t total = 0;
+
+	while (1) {
+		void *ptr;
+		unsigned len;
+		ssize_t rv;
+
+		fifo_window_exchange_writer(window);
+		if (window->len == 0) {
+			fifo_window_writer_wait(window);
+			continue;
+		}
+		ptr = fifo_window_peek_span(window, &len);
+		if (len > chunk)
+			len = chunk;
+		rv = pread(input_fd, ptr, len, total);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("pread");
+		}
+		if (rv == 0)
+			break;
+		fifo_window_eat_span(window, rv);
+		total += rv;
+	}
+	return total;
+}
+
+static
+int64_t write_egress(struct fifo_window *window)
+{
+	int64_t total = 0;
+
+	while (1) {
+		void *ptr;
+		unsigned len;
+		ssize_t rv;
+		int closed = fifo_window_writer_closed(window);
+
+		fifo_window_exchange_reader(window);
+		if (window->len == 0) {
+			if (closed)
+				break;
+			fifo_window_reader_wait(window);
+			continue;
+		}
+		ptr = fifo_window_peek_span(window, &len);
+		rv = pwrite(output_fd, ptr, len, total);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal_perror("pwrite");
+		}
+		fifo_window_eat_span(window, rv);
+		total += rv;
+	}
+	return total;
+}
+
+static
+void *reader_thread(void *dummy)
+{
+	struct fifo_window window;
+	uint32_t sum = 0;
+	int64_t count = 0;
+
+	if (setaffinity)
+		move_to_cpu(0);
+
+	fifo_window_init_reader(fifo, &window, 0, FIFO_SIZE);
+
+	if (output_path) {
+		if (use_uring) {
+			struct fifo_uring ring;
+			int rv = fifo_uring_init(&ring, fifo, depth);
+			if (rv < 0) {
+				errno = -rv;
+				fatal_perror("fifo_uring_init");
+			}
+			count = fifo_uring_egress(&ring, &window, output_fd, 0, chunk);
+			if (count < 0) {
+				errno = -count;
+				fatal_perror("fifo_uring_egress");
+			}
+			fprintf(stderr, "egress: submits %lld, enters %lld, resubmits %lld\n",
+				(long long)ring.submit_count, (long long)ring.enter_count,
+				(long long)ring.resubmit_count);
+			fifo_uring_release(&ring);
+		} else {
+			count = write_egress(&window);
+		}
+		bytes_out = count;
+		return 0;
+	}
+
+	while (1) {
+		unsigned char *ptr;
+		unsigned len, i;
+		int closed = fifo_window_writer_closed(&window);
+
+		fifo_window_exchange_reader(&window);
+		if (window.len == 0) {
+			if (closed)
+				break;
+			fifo_window_reader_wait(&window);
+			continue;
+		}
+		ptr = fifo_window_get_span(&window, &len);
+		for (i = 0; i < len; i++)
+			sum += ptr[i];
+		count += len;
+	}
+	checksum = sum;
+	bytes_out = count;
+	return 0;
+}
+
+static
+void *writer_thread(void *dummy)
+{
+	struct fifo_window window;
+	int64_t count;
+
+	if (setaffinity)
+		move_to_cpu(1);
+
+	fifo_window_init_writer(fifo, &window, 0, FIFO_SIZE);
+
+	if (use_uring) {
+		struct fifo_uring ring;
+		int rv = fifo_uring_init(&ring, fifo, depth);
+		if (rv < 0) {
+			errno = -rv;
+			fatal_perror("fifo_uring_init");
+		}
+		count = fifo_uring_ingest(&ring, &window, input_fd, 0, chunk);
+		if (count < 0) {
+			errno = -count;
+			fatal_perror("fifo_uring_ingest");
+		}
+		fprintf(stderr, "ingest: submits %lld, enters %lld, resubmits %lld, fixed buffers %d\n",
+			(long long)ring.submit_count, (long long)ring.enter_count,
+			(long long)ring.resubmit_count, ring.fixed);
+		fifo_uring_release(&ring);
+	} else {
+		count = pread_ingest(&window);
+	}
+	bytes_in = count;
+
+	fifo_window_close_writer(&window);
+	return 0;
+}
+
+static
+char *usage_text =
+	"Usage: %s [options]\n"
+	"Benchmark io_uring fifo pump against plain pread/pwrite loop.\n"
+	"This binary has %s fifo implementation.\n"
+	"  -a\tset affinity for dual- core or CPU machine\n"
+	"  -p\tuse plain pread/pwrite loop instead of io_uring\n"
+	"  -f path\tinput file (created if missing, default %s)\n"
+	"  -n bytes\tsize of created input file (default %u)\n"
+	"  -o path\twrite fifo contents to file instead of checksumming\n"
+	"  -d depth\trequests in flight (default %u)\n"
+	"  -c bytes\tbytes per request (default %u)\n"
+	"\n";
+
+static
+void usage(char **argv)
+{
+	fprintf(stderr, usage_text, argv[0], fifo_implementation_type,
+		input_path, DEFAULT_FILE_SIZE, depth, chunk);
+}
+
+int main(int argc, char **argv)
+{
+	int rv;
+	pthread_t reader, writer;
+	int optchar;
+	off_t file_size = DEFAULT_FILE_SIZE;
+	double start, elapsed;
+
+	while ((optchar = getopt(argc, argv, "apf:n:o:d:c:")) >= 0) {
+		switch (optchar) {
+		case 'a':
+			setaffinity = 1;
+			break;
+		case 'p':
+			use_uring = 0;
+			break;
+		case 'f':
+			input_path = optarg;
+			break;
+		case 'n':
+			file_size = strtoll(optarg, 0, 0);
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'd':
+			depth = strtoul(optarg, 0, 0);
+			break;
+		case 'c':
+			chunk = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+
+	if (depth == 0 || depth > FIFO_URING_MAX_DEPTH || chunk == 0) {
+		usage(argv);
+		exit(1);
+	}
+
+	prepare_input(input_path, file_size);
+	input_fd = open(input_path, O_RDONLY);
+	if (input_fd < 0)
+		fatal_perror("open(input)");
+	if (output_path) {
+		output_fd = open(output_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (output_fd < 0)
+			fatal_perror("open(output)");
+	}
+
+	rv = fifo_create(&fifo);
+	if (rv)
+		fatal_perror("fifo_create");
+
+	start = now();
+
+	rv = pthread_create(&reader, 0, reader_thread, 0);
+	if (rv)
+		fatal_perror("phread_create(&reader)");
+
+	rv = pthread_create(&writer, 0, writer_thread, 0);
+	if (rv)
+		fatal_perror("pthread_create(&writer)");
+
+	pthread_join(reader, 0);
+	pthread_join(writer, 0);
+
+	elapsed = now() - start;
+
+	printf("mode = %s, depth = %u, chunk = %u\n",
+	       use_uring ? "io_uring" : "pread", use_uring ? depth : 1, chunk);
+	printf("bytes in = %lld, bytes out = %lld, checksum = 0x%08x\n",
+	       (long long)bytes_in, (long long)bytes_out, checksum);
+	printf("elapsed = %.3f sec, %.3f GB/s\n", elapsed, bytes_in / elapsed * 1E-9);
+	printf("fifo_writer_exchange_count = %lld\n", (long long)fifo_writer_exchange_count);
+	printf("fifo_reader_exchange_count = %lld\n", (long long)fifo_reader_exchange_count);
+	printf("fifo_reader_wake_count = %lld\n", (long long)fifo_reader_wake_count);
+	printf("fifo_writer_wake_count = %lld\n", (long long)fifo_writer_wake_count);
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "merge.h"
+
+static
+void ensure_room(struct fifo_window *window, unsigned len)
+{
+	while (window->len < len) {
+		fifo_window_exchange_writer(window);
+		if (window->len >= len)
+			break;
+		fifo_window_writer_wait(window);
+	}
+}
+
+void merge_window_put_record(struct fifo_window *window, uint64_t timestamp, uint32_t type,
+			     const void *payload, unsigned len)
+{
+	unsigned size = MERGE_RECORD_SIZE(len);
+	unsigned to_end = window->size - (window->start & (window->size - 1));
+	struct merge_record *r;
+
+	/* both are multiples of MERGE_ALIGN, so gap has room for
+	 * padding header */
+	if (to_end < size) {
+		ensure_room(window, to_end);
+		r = fifo_window_peek_span(window, 0);
+		r->timestamp = 0;
+		r->len = to_end;
+		r->type = MERGE_RECORD_PADDING;
+		fifo_window_eat_span(window, to_end);
+	}
+
+	ensure_room(window, size);
+	r = fifo_window_peek_span(window, 0);
+	r->timestamp = timestamp;
+	r->len = size;
+	r->type = type;
+	memcpy(r->payload, payload, len);
+	fifo_window_eat_span(window, size);
+}
+
+/* head moved since last exchange of window */
+static inline
+int source_moved(struct fifo_window *window)
+{
+	return *(volatile unsigned *)&window->fifo->head != window->start + window->len;
+}
+
+/* finds next data record of source, consuming padding and heartbeats.
+ * Window is exchanged only when it has no complete record and there's
+ * something to exchange */
+static
+void refill(struct merge_source *s)
+{
+	struct fifo_window *w = s->window;
+
+	while (1) {
+		int closed;
+
+		if (w->len >= sizeof(struct merge_record)) {
+			struct merge_record *r = fifo_window_peek_span(w, 0);
+			if (r->type == MERGE_RECORD_DATA) {
+				s->head = r;
+				return;
+			}
+			if (r->type == MERGE_RECORD_HEARTBEAT && r->timestamp > s->watermark)
+				s->watermark = r->timestamp;
+			s->eaten += r->len;
+			fifo_window_eat_span(w, r->len);
+			continue;
+		}
+
+		s->head = 0;
+		closed = fifo_window_writer_closed(w);
+		if (!s->eaten && !source_moved(w)) {
+			s->closed = closed;
+			return;
+		}
+		fifo_window_exchange_reader(w);
+		s->eaten = 0;
+		if (w->len < sizeof(struct merge_record)) {
+			s->closed = closed;
+			return;
+		}
+	}
+}
+
+/* order of sources: data record by timestamp, empty source by
+ * watermark (after records of same timestamp, as its next record can
+ * have it too), closed source last. Index k is sentinel winning over
+ * everything, used to build tree */
+static
+int source_less(struct merge_reader *m, unsigned a, unsigned b)
+{
+	struct merge_source *sa, *sb;
+	uint64_t ka, kb;
+	int pa, pb;
+
+	if (a == m->k)
+		return 1;
+	if (b == m->k)
+		return 0;
+	sa = &m->sources[a];
+	sb = &m->sources[b];
+	ka = sa->head ? sa->head->timestamp : sa->closed ? UINT64_MAX : sa->watermark;
+	kb = sb->head ? sb->head->timestamp : sb->closed ? UINT64_MAX : sb->watermark;
+	if (ka != kb)
+		return ka < kb;
+	pa = !sa->head && !sa->closed;
+	pb = !sb->head && !sb->closed;
+	if (pa != pb)
+		return pa < pb;
+	return a < b;
+}
+
+/* plays matches from leaf of changed source up to root */
+static
+void replay(struct merge_reader *m, unsigned source)
+{
+	unsigned winner = source;
+	unsigned node;
+
+	for (node = (source + m->k) / 2; node > 0; node /= 2) {
+		if (source_less(m, m->tree[node], winner)) {
+			unsigned t = m->tree[node];
+			m->tree[node] = winner;
+			winner = t;
+		}
+	}
+	m->tree[0] = winner;
+}
+
+int merge_reader_init(struct merge_reader *m, struct fifo_window **windows, unsigned k)
+{
+	unsigned i;
+
+	if (k == 0 || k > MERGE_MAX_SOURCES)
+		return EINVAL;
+	memset(m, 0, sizeof(*m));
+	m->k = k;
+	m->last = -1;
+	for (i = 0; i < k; i++) {
+		m->sources[i].window = windows[i];
+		m->tree[i] = k;
+	}
+	/* every replay pushes one sentinel out */
+	for (i = 0; i < k; i++) {
+		refill(&m->sources[i]);
+		replay(m, i);
+	}
+	return 0;
+}
+
+const struct merge_record *merge_reader_next(struct merge_reader *m, int *source)
+{
+	struct merge_source *s;
+	unsigned winner;
+
+	if (m->last >= 0) {
+		s = &m->sources[m->last];
+		s->watermark = s->head->timestamp;
+		s->eaten += s->head->len;
+		fifo_window_eat_span(s->window, s->head->len);
+		/* give writer its room back now and then */
+		if (s->eaten >= s->window->size / 4) {
+			fifo_window_exchange_reader(s->window);
+			s->eaten = 0;
+		}
+		refill(s);
+		replay(m, m->last);
+		m->last = -1;
+	}
+
+	while (1) {
+		winner = m->tree[0];
+		s = &m->sources[winner];
+		if (s->head)
+			break;
+		if (s->closed) {
+			*source = -1;
+			return 0;
+		}
+		/* empty source holds everything back. It might have data
+		 * by now */
+		refill(s);
+		if (!s->head && !s->closed) {
+			replay(m, winner);
+			if (m->tree[0] != winner)
+				continue;
+			*source = winner;
+			return 0;
+		}
+		replay(m, winner);
+	}
+
+	m->last = winner;
+	*source = winner;
+	return s->head;
+}
+
+void merge_reader_wait(struct merge_reader *m, int source)
+{
+	fifo_window_reader_wait(m->sources[source].window);
+}
@@ -0,0 +1,70 @@
+#ifndef SHM_MERGE_H
+#define SHM_MERGE_H
+#include <stdint.h>
+
+#include "fifo.h"
+
+/* K-way merge of timestamped record streams, one fifo per source.
+ * Records are multiples of MERGE_ALIGN and never wrap around end of
+ * fifo data (writer fills the gap with padding record), so merged
+ * stream is handed out as pointers straight into fifos */
+
+#define MERGE_ALIGN 16
+#define MERGE_RECORD_SIZE(payload_len) \
+	((sizeof(struct merge_record) + (payload_len) + MERGE_ALIGN - 1) & ~(MERGE_ALIGN - 1))
+#define MERGE_MAX_SOURCES 64
+
+enum merge_record_type {
+	MERGE_RECORD_DATA,
+	MERGE_RECORD_PADDING,
+	/* promise that no later record of source has smaller
+	 * timestamp. Lets idle source be skipped */
+	MERGE_RECORD_HEARTBEAT,
+};
+
+struct merge_record {
+	uint64_t timestamp;
+	uint32_t len;		/* whole record, header and padding included */
+	uint32_t type;
+	char payload[0];
+};
+
+/* writer side: appends record to window, waiting for room. Timestamps
+ * of one source must not decrease and record must fit in fifo. Record
+ * is published by next exchange */
+void merge_window_put_record(struct fifo_window *window, uint64_t timestamp, uint32_t type,
+			     const void *payload, unsigned len);
+
+struct merge_source {
+	struct fifo_window *window;
+	struct merge_record *head;	/* next data record or 0 */
+	uint64_t watermark;	/* later records won't be older */
+	unsigned eaten;		/* since last exchange */
+	int closed;
+};
+
+struct merge_reader {
+	unsigned k;
+	int last;		/* source of record returned last */
+	/* loser tree: tree[0] is winner, tree[1..k-1] losers */
+	unsigned tree[MERGE_MAX_SOURCES];
+	struct merge_source sources[MERGE_MAX_SOURCES];
+};
+
+/* windows are reader windows of source fifos, with min_length 0 and
+ * pull_length of whole fifo. Returns 0 or EINVAL if there are too
+ * many sources */
+int merge_reader_init(struct merge_reader *m, struct fifo_window **windows, unsigned k);
+
+/* returns next record of merged stream. Pointer is valid until next
+ * call, which releases record back to its fifo. Never blocks: when
+ * next record can't be determined, because source with no data has
+ * watermark below other sources' records, returns 0 and sets
+ * *source to it (so caller may merge_reader_wait on it or do
+ * something else). Returns 0 with *source = -1 when all sources are
+ * closed and drained */
+const struct merge_record *merge_reader_next(struct merge_reader *m, int *source);
+
+void merge_reader_wait(struct merge_reader *m, int source);
+
+#endif
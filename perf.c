@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+const char *perf_counter_names[PERF_COUNTERS] = {
+	"cycles",
+	"instructions",
+	"llc_misses",
+	"context_switches",
+	"cache_transfers",
+};
+
+/* complain about every counter only once per process */
+static
+unsigned reported_failures;
+
+static
+int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+		    int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static
+int counter_attr(enum perf_counter_id id, struct perf_event_attr *attr)
+{
+	char *raw;
+
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->disabled = 1;
+	attr->exclude_hv = 1;
+	attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch (id) {
+	case PERF_CYCLES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERF_INSTRUCTIONS:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERF_LLC_MISSES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case PERF_CONTEXT_SWITCHES:
+		attr->type = PERF_TYPE_SOFTWARE;
+		attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+		break;
+	case PERF_CACHE_TRANSFERS:
+		raw = getenv("FIFO_PERF_TRANSFER_EVENT");
+		if (!raw || !*raw)
+			return -1;
+		attr->type = PERF_TYPE_RAW;
+		attr->config = strtoull(raw, 0, 0);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+void perf_counters_open(struct perf_counters *pc)
+{
+	int i;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+
+		pc->fd[i] = -1;
+		if (counter_attr(i, &attr))
+			continue;
+		pc->fd[i] = perf_event_open(&attr, 0, -1, -1, 0);
+		if (pc->fd[i] < 0) {
+			if (!(__sync_fetch_and_or(&reported_failures, 1U << i) & (1U << i)))
+				fprintf(stderr, "perf: %s counter unavailable: %s\n",
+					perf_counter_names[i], strerror(errno));
+			continue;
+		}
+	}
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void perf_counters_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		uint64_t buf[3];	/* value, time enabled, time running */
+
+		if (pc->fd[i] < 0)
+			continue;
+		if (read(pc->fd[i], buf, sizeof(buf)) == sizeof(buf) && buf[2]) {
+			double scale = (double)buf[1] / buf[2];
+			pc->value[i] = (uint64_t)(buf[0] * scale);
+			pc->valid |= 1U << i;
+		}
+		close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+void perf_counters_print(FILE *f, const char *label, const struct perf_counters *pc,
+			 uint64_t bytes, uint64_t exchanges)
+{
+	int i;
+
+	fprintf(f, "%s:", label);
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (!perf_counter_valid(pc, i)) {
+			fprintf(f, " %s=n/a", perf_counter_names[i]);
+			continue;
+		}
+		fprintf(f, " %s=%llu (%.3g/B, %.3g/exch)", perf_counter_names[i],
+			(unsigned long long)pc->value[i],
+			bytes ? (double)pc->value[i] / bytes : 0.0,
+			exchanges ? (double)pc->value[i] / exchanges : 0.0);
+	}
+	if (perf_counter_valid(pc, PERF_CYCLES) && perf_counter_valid(pc, PERF_INSTRUCTIONS) &&
+	    pc->value[PERF_CYCLES])
+		fprintf(f, " ipc=%.2f", (double)pc->value[PERF_INSTRUCTIONS] / pc->value[PERF_CYCLES]);
+	fprintf(f, "\n");
+}
@@ -0,0 +1,48 @@
+#ifndef SHM_PERF_H
+#define SHM_PERF_H
+#include <stdint.h>
+#include <stdio.h>
+
+/* per-thread hardware and software counters via perf_event_open.
+ * Every counter is opened separately, so that missing PMU support,
+ * perf_event_paranoid restrictions or virtualization only disable
+ * counters that can't be opened */
+enum perf_counter_id {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_CONTEXT_SWITCHES,
+	/* model-specific event counting cache lines pulled from other
+	 * core's cache (e.g. XSNP_HITM on Intel). Only opened when
+	 * FIFO_PERF_TRANSFER_EVENT environment variable holds raw
+	 * event code */
+	PERF_CACHE_TRANSFERS,
+	PERF_COUNTERS
+};
+
+struct perf_counters {
+	int fd[PERF_COUNTERS];
+	unsigned valid;		/* bitmask of counters with value */
+	uint64_t value[PERF_COUNTERS];
+};
+
+extern const char *perf_counter_names[PERF_COUNTERS];
+
+/* starts counting in calling thread */
+void perf_counters_open(struct perf_counters *pc);
+/* stops counting, fills values (scaled if counters were multiplexed)
+ * and closes counters */
+void perf_counters_close(struct perf_counters *pc);
+
+static inline
+int perf_counter_valid(const struct perf_counters *pc, enum perf_counter_id id)
+{
+	return (pc->valid >> id) & 1;
+}
+
+/* prints every counter raw, per byte and per exchange on single
+ * line. Unavailable counters are printed as n/a */
+void perf_counters_print(FILE *f, const char *label, const struct perf_counters *pc,
+			 uint64_t bytes, uint64_t exchanges);
+
+#endif
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "pipeline.h"
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static
+void move_to_cpu(int number)
+{
+	pid_t tid = syscall(__NR_gettid);
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(number, &set);
+	if (sched_setaffinity(tid, sizeof(set), &set) < 0)
+		perror("pipeline:sched_setaffinity");
+}
+
+void pipeline_init(struct pipeline *p, unsigned fifo_size)
+{
+	memset(p, 0, sizeof(*p));
+	p->fifo_size = fifo_size;
+}
+
+struct pipeline_stage *pipeline_add_stage(struct pipeline *p, const char *name,
+					  pipeline_stage_fn fn, void *arg, int cpu)
+{
+	struct pipeline_stage *s;
+
+	if (p->stages_count == PIPELINE_MAX_STAGES)
+		return 0;
+	s = &p->stages[p->stages_count++];
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->fn = fn;
+	s->arg = arg;
+	s->cpu = cpu;
+	return s;
+}
+
+struct pipeline_stage *pipeline_add_transform(struct pipeline *p, const char *name,
+					      pipeline_transform_fn fn, void *arg)
+{
+	struct pipeline_stage *s;
+
+	/* needs thread stage to fuse into */
+	if (!p->stages_count)
+		return 0;
+	s = pipeline_add_stage(p, name, 0, arg, -1);
+	if (s)
+		s->transform = fn;
+	return s;
+}
+
+/* applies fused transforms to span [start, start + len) that stage
+ * just produced into out window, piece by piece at fifo wrap */
+static
+void run_transforms(struct pipeline_stage *s, struct fifo_window *out,
+		    unsigned start, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < s->transforms_count; i++) {
+		struct pipeline_stage *t = &s->transforms[i];
+		unsigned done = 0;
+		double t0 = now();
+
+		while (done < len) {
+			unsigned offset = (start + done) & (out->size - 1);
+			unsigned piece = len - done;
+			if (piece > out->size - offset)
+				piece = out->size - offset;
+			t->transform(t, &out->fifo->data[offset], piece, s->out_pos + done);
+			done += piece;
+		}
+		t->stats.seconds += now() - t0;
+		t->stats.bytes_in += len;
+		t->stats.bytes_out += len;
+	}
+}
+
+/* reads and drops rest of stream until its writer closes fifo. Stands
+ * in for stage which ended early or failed to start, so that stages
+ * before it aren't stuck on full fifo */
+static
+void drain(struct fifo_window *window)
+{
+	while (1) {
+		int closed = fifo_window_writer_closed(window);
+		fifo_window_exchange_reader(window);
+		if (window->len) {
+			fifo_window_eat_span(window, window->len);
+			continue;
+		}
+		if (closed)
+			break;
+		fifo_window_reader_wait(window);
+	}
+}
+
+static
+void *stage_thread(void *arg)
+{
+	struct pipeline_stage *s = arg;
+	struct fifo_window in, out;
+	struct fifo_window *inp = 0, *outp = 0;
+	double start, t;
+	int done = 0;
+
+	if (s->cpu >= 0)
+		move_to_cpu(s->cpu);
+
+	/* min_length is 0, runtime decides itself when to wait */
+	if (s->in_fifo) {
+		fifo_window_init_reader(s->in_fifo, &in, 0, s->in_fifo->size);
+		inp = &in;
+	}
+	if (s->out_fifo) {
+		fifo_window_init_writer(s->out_fifo, &out, 0, s->out_fifo->size);
+		outp = &out;
+	}
+
+	start = now();
+	while (1) {
+		unsigned in_start = 0, out_start = 0;
+		unsigned consumed = 0, produced = 0;
+		int closed = 0;
+
+		/* pipeline_run gave up or later stage ended early,
+		 * first stage ends stream */
+		if (!inp && s->stop)
+			break;
+
+		/* output first, so that nothing produced stays
+		 * unpublished while we sleep for input */
+		if (outp) {
+			fifo_window_exchange_writer(outp);
+			if (outp->len == 0) {
+				t = now();
+				fifo_window_writer_wait(outp);
+				s->stats.blocked += now() - t;
+				continue;
+			}
+			out_start = outp->start;
+		}
+		if (inp) {
+			closed = fifo_window_writer_closed(inp);
+			fifo_window_exchange_reader(inp);
+			if (inp->len == 0) {
+				if (closed)
+					break;
+				t = now();
+				fifo_window_reader_wait(inp);
+				s->stats.starved += now() - t;
+				continue;
+			}
+			in_start = inp->start;
+		}
+
+		done = s->fn(s, inp, outp);
+
+		if (inp) {
+			consumed = inp->start - in_start;
+			s->stats.bytes_in += consumed;
+		}
+		if (outp) {
+			produced = outp->start - out_start;
+			run_transforms(s, outp, out_start, produced);
+			s->out_pos += produced;
+			s->stats.bytes_out += produced;
+		}
+		if (done)
+			break;
+
+		if (consumed || produced)
+			continue;
+
+		/* stage needs more input (e.g. whole record) or more
+		 * room than there is. Both windows hold everything
+		 * available, so side which can't grow anymore isn't
+		 * the short one: input is short while it can get more
+		 * data, otherwise output is short while it can get
+		 * more room */
+		t = now();
+		if (inp && !closed && inp->len < inp->size) {
+			fifo_window_reader_wait(inp);
+			s->stats.starved += now() - t;
+		} else if (outp && outp->len < outp->size) {
+			fifo_window_writer_wait(outp);
+			s->stats.blocked += now() - t;
+		} else {
+			/* input ended with partial record, or stage
+			 * wants more than fifo holds */
+			fprintf(stderr, "pipeline:%s: no progress possible, %u input bytes dropped\n",
+				s->name, inp ? inp->len : 0);
+			break;
+		}
+	}
+
+	/* end of stream goes downstream. Input left is dropped, and if
+	 * stage ended early stream is stopped at first stage, so that
+	 * stages before us finish instead of blocking on full fifo */
+	if (outp) {
+		fifo_window_close_writer(outp);
+		s->stats.out_stats = outp->stats;
+	}
+	if (inp) {
+		if (done)
+			s->source->stop = 1;
+		drain(inp);
+		s->stats.in_stats = inp->stats;
+	}
+	s->stats.seconds = now() - start;
+	return 0;
+}
+
+int pipeline_run(struct pipeline *p)
+{
+	struct pipeline_stage *prev = 0;
+	double start;
+	unsigned i;
+	int rv;
+
+	/* wire thread stages with fifos, attach transforms to thread
+	 * stage before them */
+	for (i = 0; i < p->stages_count; i++) {
+		struct pipeline_stage *s = &p->stages[i];
+
+		s->source = &p->stages[0];
+		if (s->transform) {
+			if (!prev->transforms)
+				prev->transforms = s;
+			prev->transforms_count++;
+			continue;
+		}
+		if (prev) {
+			struct shm_fifo *fifo;
+			rv = fifo_create_sized(&fifo, p->fifo_size);
+			if (rv)
+				return rv;
+			p->fifos[p->fifos_count++] = fifo;
+			prev->out_fifo = fifo;
+			s->in_fifo = fifo;
+		}
+		prev = s;
+	}
+	if (!prev || (prev->transforms_count && !prev->out_fifo))
+		return EINVAL;
+
+	start = now();
+	for (i = 0; i < p->stages_count; i++) {
+		struct pipeline_stage *s = &p->stages[i];
+		if (s->transform)
+			continue;
+		rv = pthread_create(&s->thread, 0, stage_thread, s);
+		if (rv)
+			goto out_stop;
+	}
+	for (i = 0; i < p->stages_count; i++)
+		if (!p->stages[i].transform)
+			pthread_join(p->stages[i].thread, 0);
+	p->seconds = now() - start;
+	return 0;
+
+out_stop:
+	/* stages before i are running and fifos must outlive them:
+	 * close stream at first stage and let it flow into nowhere */
+	if (i) {
+		struct fifo_window window;
+		unsigned j;
+
+		p->stages[0].stop = 1;
+		fifo_window_init_reader(p->stages[i].in_fifo, &window, 0, p->fifo_size);
+		drain(&window);
+		for (j = 0; j < i; j++)
+			if (!p->stages[j].transform)
+				pthread_join(p->stages[j].thread, 0);
+	}
+	return rv;
+}
+
+/* part of stage lifetime spent doing work (fused transforms
+ * included) rather than sleeping */
+static
+double busy_fraction(struct pipeline_stage *s)
+{
+	if (s->stats.seconds <= 0)
+		return 0;
+	return (s->stats.seconds - s->stats.starved - s->stats.blocked) / s->stats.seconds;
+}
+
+void pipeline_report(struct pipeline *p, FILE *f)
+{
+	struct pipeline_stage *bottleneck = 0, *host = 0;
+	unsigned i;
+
+	for (i = 0; i < p->stages_count; i++) {
+		struct pipeline_stage *s = &p->stages[i];
+		if (!s->transform && (!bottleneck || busy_fraction(s) > busy_fraction(bottleneck)))
+			bottleneck = s;
+	}
+
+	fprintf(f, "%-16s %5s %10s %10s %8s %7s %8s %8s %10s\n", "stage", "cpu", "MB in", "MB out",
+		"GB/s", "busy%", "starved%", "blocked%", "exchanges");
+	for (i = 0; i < p->stages_count; i++) {
+		struct pipeline_stage *s = &p->stages[i];
+		uint64_t bytes = s->stats.bytes_in > s->stats.bytes_out ?
+			s->stats.bytes_in : s->stats.bytes_out;
+
+		if (s->transform) {
+			/* speed of transform itself, busy share of host
+			 * thread */
+			fprintf(f, "+%-15s %5s %10.1f %10.1f %8.3f %7.1f %8s %8s %10s\n", s->name, "fused",
+				s->stats.bytes_in * 1E-6, s->stats.bytes_out * 1E-6,
+				s->stats.seconds > 0 ? bytes / s->stats.seconds * 1E-9 : 0,
+				host && host->stats.seconds > 0 ?
+				s->stats.seconds / host->stats.seconds * 100 : 0,
+				"-", "-", "-");
+			continue;
+		}
+		host = s;
+		fprintf(f, "%-16s %5d %10.1f %10.1f %8.3f %7.1f %8.1f %8.1f %10lld%s\n", s->name, s->cpu,
+			s->stats.bytes_in * 1E-6, s->stats.bytes_out * 1E-6,
+			s->stats.seconds > 0 ? bytes / s->stats.seconds * 1E-9 : 0,
+			busy_fraction(s) * 100,
+			s->stats.seconds > 0 ? s->stats.starved / s->stats.seconds * 100 : 0,
+			s->stats.seconds > 0 ? s->stats.blocked / s->stats.seconds * 100 : 0,
+			(long long)(s->stats.in_stats.exchange_count + s->stats.out_stats.exchange_count),
+			s == bottleneck ? "  <- bottleneck" : "");
+	}
+	fprintf(f, "total %.3f sec\n", p->seconds);
+}
+
+void pipeline_destroy(struct pipeline *p)
+{
+	unsigned i;
+
+	for (i = 0; i < p->fifos_count; i++)
+		fifo_destroy(p->fifos[i]);
+	p->fifos_count = 0;
+}
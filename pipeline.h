@@ -0,0 +1,96 @@
+#ifndef SHM_PIPELINE_H
+#define SHM_PIPELINE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "fifo.h"
+
+/* chain of stages connected by fifos. Every thread stage runs in its
+ * own (optionally pinned) thread and gets reader window of fifo from
+ * previous thread stage and writer window of fifo to next one. Full
+ * fifo blocks producer (backpressure), end of stream is propagated
+ * downstream by closing fifos */
+
+#define PIPELINE_MAX_STAGES 16
+
+struct pipeline_stage;
+
+/* processes data of in window (0 for first stage) into out window (0
+ * for last stage), eating what was consumed and produced. Runtime
+ * exchanges windows between calls, sleeps when there's no input or
+ * no room for output, and closes out once input is closed and
+ * drained or fn returned non-zero (which is how first stage ends
+ * stream). Later stage returning non-zero stops first stage too; its
+ * remaining input is read and dropped until the stop reaches it.
+ * When fn makes no progress, runtime waits for more input while
+ * input fifo can still grow, then for more room. If neither can
+ * come (input closed mid-record), rest of input is dropped */
+typedef int (*pipeline_stage_fn)(struct pipeline_stage *stage,
+				 struct fifo_window *in, struct fifo_window *out);
+
+/* in-place processing of len bytes at stream position pos */
+typedef void (*pipeline_transform_fn)(struct pipeline_stage *stage,
+				      void *p, unsigned len, uint64_t pos);
+
+struct pipeline_stage_stats {
+	uint64_t bytes_in, bytes_out;
+	double seconds;		/* lifetime of stage thread */
+	double starved;		/* sleeping for input */
+	double blocked;		/* sleeping for room in output */
+	struct fifo_window_stats in_stats, out_stats;
+};
+
+struct pipeline_stage {
+	const char *name;
+	pipeline_stage_fn fn;
+	pipeline_transform_fn transform;
+	void *arg;
+	int cpu;		/* -1 means not pinned */
+	struct pipeline_stage_stats stats;
+
+	/* private to runtime */
+	pthread_t thread;
+	struct shm_fifo *in_fifo, *out_fifo;
+	struct pipeline_stage *transforms;	/* first fused transform */
+	unsigned transforms_count;
+	uint64_t out_pos;
+	struct pipeline_stage *source;	/* first stage */
+	volatile int stop;	/* first stage: end stream now */
+};
+
+struct pipeline {
+	unsigned fifo_size;
+	unsigned stages_count;
+	struct pipeline_stage stages[PIPELINE_MAX_STAGES];
+	struct shm_fifo *fifos[PIPELINE_MAX_STAGES];
+	unsigned fifos_count;
+	double seconds;
+};
+
+void pipeline_init(struct pipeline *p, unsigned fifo_size);
+
+/* adds stage running in its own thread, pinned to cpu unless it's
+ * -1. Returns 0 if there are too many stages */
+struct pipeline_stage *pipeline_add_stage(struct pipeline *p, const char *name,
+					  pipeline_stage_fn fn, void *arg, int cpu);
+
+/* adds transform fused into previous thread stage: it's applied on
+ * that stage's thread to every span it produced, before span is
+ * published. Data is forwarded while still in that core's cache and
+ * without extra fifo and copy. Must not follow last thread stage */
+struct pipeline_stage *pipeline_add_transform(struct pipeline *p, const char *name,
+					      pipeline_transform_fn fn, void *arg);
+
+/* creates fifos, runs all stages until end of stream propagates to
+ * last one. Returns 0 or errno. If some stage thread can't be
+ * created, stages already running are stopped and joined first */
+int pipeline_run(struct pipeline *p);
+
+/* per-stage throughput and stall times. Stage which was starved or
+ * blocked least is marked as bottleneck */
+void pipeline_report(struct pipeline *p, FILE *f);
+
+void pipeline_destroy(struct pipeline *p);
+
+#endif
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "workload.h"
+
+/* vector width follows what -march enables, 32-byte vectors without
+ * AVX2 would be split anyway */
+#ifdef __AVX2__
+#define VECTOR_BYTES 32
+#else
+#define VECTOR_BYTES 16
+#endif
+
+typedef uint32_t v32u __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint64_t v64u __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint8_t v8u __attribute__((vector_size(VECTOR_BYTES)));
+typedef int8_t v8s __attribute__((vector_size(VECTOR_BYTES)));
+
+#define LANES32 (VECTOR_BYTES / 4)
+
+/* spans are only 4-byte aligned, memcpy compiles to unaligned vector
+ * load/store */
+static inline
+v32u load32(const void *p)
+{
+	v32u v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline
+void store32(void *p, v32u v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline
+uint32_t hash32(uint32_t x)
+{
+	x *= 0x9e3779b1U;
+	x ^= x >> 15;
+	x *= 0x85ebca77U;
+	x ^= x >> 13;
+	return x;
+}
+
+/* hash32 of LANES32 consecutive word indexes */
+static inline
+v32u hash32_vector(v32u x)
+{
+	x *= 0x9e3779b1U;
+	x ^= x >> 15;
+	x *= 0x85ebca77U;
+	x ^= x >> 13;
+	return x;
+}
+
+static inline
+v32u word_indexes(uint32_t first)
+{
+	v32u v;
+	unsigned i;
+	for (i = 0; i < LANES32; i++)
+		v[i] = first + i;
+	return v;
+}
+
+/* none: writer stores zeros, reader ORs words. Closest to original
+ * JUST_MEMCPY build */
+
+static
+void none_produce(struct workload_state *st, void *p, unsigned len, uint64_t pos)
+{
+	memset(p, 0, len);
+}
+
+static
+void none_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const uint32_t *w = p;
+	uint32_t acc = 0;
+	unsigned i;
+	for (i = 0; i < len / 4; i++)
+		acc |= w[i];
+	st->acc |= acc;
+}
+
+/* nrand48: original scalar generation and verification */
+
+static
+void nrand48_produce(struct workload_state *st, void *p, unsigned len, uint64_t pos)
+{
+	int *w = p;
+	unsigned i;
+	for (i = 0; i < len / 4; i++)
+		w[i] = nrand48(st->xsubi);
+}
+
+static
+void nrand48_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const int *w = p;
+	unsigned i;
+	for (i = 0; i < len / 4; i++)
+		if (w[i] != nrand48(st->xsubi))
+			st->errors++;
+}
+
+/* prng: counter-based hash of word index, generated and verified
+ * LANES32 words at a time */
+
+static
+void prng_fill(void *p, unsigned len, uint64_t pos)
+{
+	char *c = p;
+	uint32_t index = pos / 4;
+	unsigned i = 0;
+
+	for (; i + VECTOR_BYTES <= len; i += VECTOR_BYTES, index += LANES32)
+		store32(c + i, hash32_vector(word_indexes(index)));
+	for (; i < len; i += 4, index++) {
+		uint32_t v = hash32(index);
+		memcpy(c + i, &v, 4);
+	}
+}
+
+static
+void prng_produce(struct workload_state *st, void *p, unsigned len, uint64_t pos)
+{
+	prng_fill(p, len, pos);
+}
+
+static
+void prng_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const char *c = p;
+	uint32_t index = pos / 4;
+	v32u diff = {0};
+	unsigned i = 0, j;
+
+	for (; i + VECTOR_BYTES <= len; i += VECTOR_BYTES, index += LANES32) {
+		v32u expected = hash32_vector(word_indexes(index));
+		/* lanes are -1 where data differs */
+		diff += (v32u)(load32(c + i) != expected);
+	}
+	for (j = 0; j < LANES32; j++)
+		st->errors += -diff[j] & 0xffffffffU;
+	for (; i < len; i += 4, index++) {
+		uint32_t v;
+		memcpy(&v, c + i, 4);
+		if (v != hash32(index))
+			st->errors++;
+	}
+}
+
+/* checksum: writer generates prng data, reader computes position
+ * weighted sum of words in 64-bit lanes (catches reordering, unlike
+ * plain sum) */
+
+static
+void checksum_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const char *c = p;
+	uint32_t index = pos / 4;
+	v64u lo = {0}, hi = {0};
+	unsigned i = 0, j;
+
+	for (; i + VECTOR_BYTES <= len; i += VECTOR_BYTES, index += LANES32) {
+		v32u words = load32(c + i);
+		v32u weights = word_indexes(index) | 1;
+		v32u mixed = words * weights;
+		v64u a, b;
+		for (j = 0; j < LANES32 / 2; j++) {
+			a[j] = mixed[j];
+			b[j] = mixed[j + LANES32 / 2];
+		}
+		lo += a;
+		hi += b;
+	}
+	for (j = 0; j < LANES32 / 2; j++)
+		st->acc += lo[j] + hi[j];
+	for (; i < len; i += 4, index++) {
+		uint32_t v;
+		memcpy(&v, c + i, 4);
+		st->acc += (uint32_t)(v * (index | 1));
+	}
+}
+
+/* scan: text-like bytes with newline delimiter on average every 64
+ * bytes. Reader counts delimiters with vector compares */
+
+#define DELIMITER '\n'
+
+static
+void scan_produce(struct workload_state *st, void *p, unsigned len, uint64_t pos)
+{
+	uint8_t *c = p;
+	unsigned i = 0;
+
+	prng_fill(p, len, pos);
+	/* map random bytes to 16 lowercase letters, 1/64 of them to
+	 * delimiter */
+	for (; i + VECTOR_BYTES <= len; i += VECTOR_BYTES) {
+		v8u b, delimiter;
+		memcpy(&b, c + i, sizeof(b));
+		delimiter = (v8u)(b < 4);
+		b = (delimiter & DELIMITER) | (~delimiter & ('a' + (b & 15)));
+		memcpy(c + i, &b, sizeof(b));
+	}
+	for (; i < len; i++)
+		c[i] = (c[i] < 4) ? DELIMITER : 'a' + (c[i] & 15);
+}
+
+static
+void scan_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const uint8_t *c = p;
+	uint64_t count = 0;
+	unsigned i = 0;
+
+	while (i + VECTOR_BYTES <= len) {
+		/* byte lanes count down from 0 and can't wrap within
+		 * 255 iterations */
+		v8s acc = {0};
+		unsigned j, rounds = 0;
+		for (; i + VECTOR_BYTES <= len && rounds < 255; i += VECTOR_BYTES, rounds++) {
+			v8u v;
+			memcpy(&v, c + i, sizeof(v));
+			acc += (v8s)(v == DELIMITER);
+		}
+		for (j = 0; j < VECTOR_BYTES; j++)
+			count += (uint8_t)-acc[j];
+	}
+	for (; i < len; i++)
+		count += (c[i] == DELIMITER);
+	st->acc += count;
+}
+
+/* decode: fixed-size market-data-like records. Reader decodes every
+ * field, checks sequence numbers and aggregates notional. Both sides
+ * work on LANES32 records at a time: four vectors of records are
+ * transposed into vectors of seq, price, qty|flags and timestamp
+ * words (transpose is its own inverse, writer uses it to go back) */
+
+struct record {
+	uint32_t seq;
+	uint32_t price;
+	uint16_t qty;
+	uint16_t flags;
+	uint32_t timestamp;
+};
+
+#define RECORD_SIZE 16
+#define RECORD_BLOCK (4 * VECTOR_BYTES)
+
+/* every 16-byte half of vector is 4x4 word transpose on its own, so
+ * with 32-byte vectors lanes come in record order 0 2 4 6 1 3 5 7 */
+#if VECTOR_BYTES == 32
+#define INTERLEAVE_LO {0, 8, 1, 9, 4, 12, 5, 13}
+#define INTERLEAVE_HI {2, 10, 3, 11, 6, 14, 7, 15}
+#define PAIR_LO {0, 1, 8, 9, 4, 5, 12, 13}
+#define PAIR_HI {2, 3, 10, 11, 6, 7, 14, 15}
+#define RECORD_ORDER {0, 2, 4, 6, 1, 3, 5, 7}
+#else
+#define INTERLEAVE_LO {0, 4, 1, 5}
+#define INTERLEAVE_HI {2, 6, 3, 7}
+#define PAIR_LO {0, 1, 4, 5}
+#define PAIR_HI {2, 3, 6, 7}
+#define RECORD_ORDER {0, 1, 2, 3}
+#endif
+
+static inline
+void transpose4(v32u *a, v32u *b, v32u *c, v32u *d)
+{
+	const v32u interleave_lo = INTERLEAVE_LO, interleave_hi = INTERLEAVE_HI;
+	const v32u pair_lo = PAIR_LO, pair_hi = PAIR_HI;
+	v32u ab_lo = __builtin_shuffle(*a, *b, interleave_lo);
+	v32u ab_hi = __builtin_shuffle(*a, *b, interleave_hi);
+	v32u cd_lo = __builtin_shuffle(*c, *d, interleave_lo);
+	v32u cd_hi = __builtin_shuffle(*c, *d, interleave_hi);
+
+	*a = __builtin_shuffle(ab_lo, cd_lo, pair_lo);
+	*b = __builtin_shuffle(ab_lo, cd_lo, pair_hi);
+	*c = __builtin_shuffle(ab_hi, cd_hi, pair_lo);
+	*d = __builtin_shuffle(ab_hi, cd_hi, pair_hi);
+}
+
+static
+void decode_produce(struct workload_state *st, void *p, unsigned len, uint64_t pos)
+{
+	const v32u order = RECORD_ORDER;
+	char *c = p;
+	uint32_t seq = pos / RECORD_SIZE;
+	unsigned i = 0;
+
+	for (; i + RECORD_BLOCK <= len; i += RECORD_BLOCK, seq += LANES32) {
+		v32u seqs = seq + order;
+		v32u h = hash32_vector(seqs);
+		v32u prices = 10000 + (h & 0xfff);
+		v32u qty_flags = (1 + (h >> 12) % 1000) | (h >> 28) << 16;
+		v32u timestamps = seqs * 3;
+
+		transpose4(&seqs, &prices, &qty_flags, &timestamps);
+		store32(c + i, seqs);
+		store32(c + i + VECTOR_BYTES, prices);
+		store32(c + i + 2 * VECTOR_BYTES, qty_flags);
+		store32(c + i + 3 * VECTOR_BYTES, timestamps);
+	}
+	for (; i < len; i += RECORD_SIZE, seq++) {
+		struct record r;
+		uint32_t h = hash32(seq);
+		r.seq = seq;
+		r.price = 10000 + (h & 0xfff);
+		r.qty = 1 + (h >> 12) % 1000;
+		r.flags = h >> 28;
+		r.timestamp = seq * 3;
+		memcpy(c + i, &r, RECORD_SIZE);
+	}
+}
+
+static
+void decode_consume(struct workload_state *st, const void *p, unsigned len, uint64_t pos)
+{
+	const v32u order = RECORD_ORDER;
+	const char *c = p;
+	uint32_t seq = pos / RECORD_SIZE;
+	uint64_t notional = 0;
+	unsigned errors = 0;
+	v32u bad = {0};
+	v64u lo = {0}, hi = {0};
+	unsigned i = 0, j;
+
+	for (; i + RECORD_BLOCK <= len; i += RECORD_BLOCK, seq += LANES32) {
+		v32u seqs = load32(c + i);
+		v32u prices = load32(c + i + VECTOR_BYTES);
+		v32u qty_flags = load32(c + i + 2 * VECTOR_BYTES);
+		v32u timestamps = load32(c + i + 3 * VECTOR_BYTES);
+		v32u qty;
+		v64u price_lo, price_hi, qty_lo, qty_hi;
+
+		transpose4(&seqs, &prices, &qty_flags, &timestamps);
+		/* lanes are -1 where sequence is wrong */
+		bad += (v32u)(seqs != seq + order);
+		/* flags bit 0 set means record doesn't count */
+		qty = (qty_flags & 0xffff) & (v32u)((qty_flags & 0x10000) == 0);
+		for (j = 0; j < LANES32 / 2; j++) {
+			price_lo[j] = prices[j];
+			price_hi[j] = prices[j + LANES32 / 2];
+			qty_lo[j] = qty[j];
+			qty_hi[j] = qty[j + LANES32 / 2];
+		}
+		lo += price_lo * qty_lo;
+		hi += price_hi * qty_hi;
+	}
+	for (j = 0; j < LANES32; j++)
+		errors += -bad[j];
+	for (j = 0; j < LANES32 / 2; j++)
+		notional += lo[j] + hi[j];
+	for (; i < len; i += RECORD_SIZE, seq++) {
+		struct record r;
+		memcpy(&r, c + i, RECORD_SIZE);
+		errors += (r.seq != seq);
+		if (!(r.flags & 1))
+			notional += (uint64_t)r.price * r.qty;
+	}
+	st->acc += notional;
+	st->errors += errors;
+}
+
+const struct workload workloads[] = {
+	{"none", "writer stores zeros, reader ORs words", 4,
+	 none_produce, none_consume},
+	{"nrand48", "scalar nrand48 generation and verification", 4,
+	 nrand48_produce, nrand48_consume},
+	{"prng", "vectorized counter-based PRNG fill and verify", 4,
+	 prng_produce, prng_consume},
+	{"checksum", "PRNG fill, vectorized position-weighted checksum", 4,
+	 prng_produce, checksum_consume},
+	{"scan", "text fill, vectorized newline counting", 4,
+	 scan_produce, scan_consume},
+	{"decode", "vectorized 16-byte record encode, decode with sequence check", RECORD_SIZE,
+	 decode_produce, decode_consume},
+	{0}
+};
+
+const struct workload *workload_find(const char *name)
+{
+	const struct workload *w;
+	for (w = workloads; w->name; w++)
+		if (!strcmp(w->name, name))
+			return w;
+	return 0;
+}
+
+void workload_list(FILE *f)
+{
+	const struct workload *w;
+	for (w = workloads; w->name; w++)
+		fprintf(f, "    %-10s%s\n", w->name, w->description);
+}
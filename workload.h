@@ -0,0 +1,34 @@
+#ifndef SHM_WORKLOAD_H
+#define SHM_WORKLOAD_H
+#include <stdint.h>
+#include <stdio.h>
+
+/* per-thread state of workload. acc is workload-specific result
+ * (checksum, count of delimiters etc), errors counts data that
+ * failed verification */
+struct workload_state {
+	uint64_t acc;
+	uint64_t errors;
+	unsigned short xsubi[3];
+};
+
+/* data processing run on every span of transport. produce fills
+ * len bytes that are bytes [pos, pos + len) of stream, consume
+ * processes them in place. len and pos are always multiples of
+ * unit. Most kernels use GCC vector extensions and derive data from
+ * stream position only, so spans can be processed independently */
+struct workload {
+	const char *name;
+	const char *description;
+	unsigned unit;
+	void (*produce)(struct workload_state *st, void *p, unsigned len, uint64_t pos);
+	void (*consume)(struct workload_state *st, const void *p, unsigned len, uint64_t pos);
+};
+
+extern const struct workload workloads[];
+
+/* returns 0 if there's no workload with such name */
+const struct workload *workload_find(const char *name);
+void workload_list(FILE *f);
+
+#endif